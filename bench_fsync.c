@@ -0,0 +1,112 @@
+// Throughput of small synchronous writes from concurrent threads, with and
+// without group commit.
+//
+//   ./bench_fsync [threads ...]     default: 1 4 16 64
+//
+// Each thread repeatedly writes 512 bytes to a file of its own and
+// fsyncs it, for DURATION seconds. Every thread count is run with
+// commit_delay 0 (batches form only while a commit is in flight) and with
+// the default delay, each in a separate process against a fresh journal
+// in /tmp. The operations behind the FUSE callbacks are called directly.
+#define main jsonfs_main
+#include "jsonfs.c"
+#undef main
+
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DURATION 2.0
+#define WRITE_SIZE 512
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double deadline;
+static atomic_long total_syncs;
+
+static void *writer(void *arg) {
+    char name[32], data[WRITE_SIZE];
+    snprintf(name, sizeof(name), "f%ld", (long)arg);
+    memset(data, 'x', sizeof(data));
+
+    struct stat st;
+    int inode = node_create(0, name, FS_REG, &st);
+    if (inode < 0) return NULL;
+    long n = 0;
+    for (off_t offset = 0; now() < deadline; offset += WRITE_SIZE, n++) {
+        if (node_write(inode, data, sizeof(data), offset) != WRITE_SIZE || journal_sync() != 0) {
+            fprintf(stderr, "write to %s failed\n", name);
+            exit(1);
+        }
+    }
+    atomic_fetch_add(&total_syncs, n);
+    return NULL;
+}
+
+static int run(int threads, int delay) {
+    char image[] = "/tmp/bench_fsync.XXXXXX";
+    int fd = mkstemp(image);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    dprintf(fd, "[ { \"inode\": 0, \"type\": \"dir\", \"entries\": [ ] } ]\n");
+    close(fd);
+    char journal_path[sizeof(image) + 8];
+    snprintf(journal_path, sizeof(journal_path), "%s.journal", image);
+
+    commit_delay_us = delay;
+    load_json_fs(image);
+    journal_open(journal_path, image);
+
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    deadline = now() + DURATION;
+    for (long i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, writer, (void *)i);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    fprintf(stderr, "%3d threads, commit_delay %4d us: %8.0f fsyncs/s  ", threads, delay, total_syncs / DURATION);
+    journal_print_stats();
+    unlink(journal_path);
+    unlink(image);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    static const int default_threads[] = { 1, 4, 16, 64 };
+    static const int delays[] = { 0, DEFAULT_COMMIT_DELAY_US };
+    int num_counts = argc > 1 ? argc - 1 : 4;
+
+    for (int c = 0; c < num_counts; c++) {
+        int threads = argc > 1 ? atoi(argv[c + 1]) : default_threads[c];
+        if (threads <= 0) {
+            fprintf(stderr, "bad thread count %s\n", argv[c + 1]);
+            return 1;
+        }
+
+        for (int d = 0; d < 2; d++) {
+            fflush(stderr);
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("fork");
+                return 1;
+            }
+            if (pid == 0) _exit(run(threads, delays[d]));
+
+            int status;
+            waitpid(pid, &status, 0);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                fprintf(stderr, "%3d threads: failed\n", threads);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,111 @@
+// Create and lookup throughput of the inode table.
+//
+//   ./bench_inodes [count ...]     default: 10000 1000000 10000000
+//
+// Each count runs in its own process against an empty file system with
+// max_inodes set just above the count. Files are spread over directories
+// of FILES_PER_DIR entries. The operations behind the FUSE callbacks are
+// called directly, by inode, so this measures the file system itself and
+// not the kernel round trip.
+#define main jsonfs_main
+#include "jsonfs.c"
+#undef main
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FILES_PER_DIR 1000
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(int count) {
+    char image[] = "/tmp/bench_inodes.XXXXXX";
+    int fd = mkstemp(image);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    dprintf(fd, "[ { \"inode\": 0, \"type\": \"dir\", \"entries\": [ ] } ]\n");
+    close(fd);
+
+    int num_dirs = (count + FILES_PER_DIR - 1) / FILES_PER_DIR;
+    max_inodes = count + num_dirs + 1;
+    load_json_fs(image);
+    unlink(image);
+
+    int *dirs = malloc(num_dirs * sizeof(int));
+    if (!dirs) return 1;
+    struct stat st;
+    char name[32];
+
+    double start = now();
+    for (int d = 0; d < num_dirs; d++) {
+        snprintf(name, sizeof(name), "d%d", d);
+        dirs[d] = node_create(0, name, FS_DIR, &st);
+        if (dirs[d] < 0) {
+            fprintf(stderr, "mkdir %s failed\n", name);
+            return 1;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "f%d", i % FILES_PER_DIR);
+        if (node_create(dirs[i / FILES_PER_DIR], name, FS_REG, &st) < 0) {
+            fprintf(stderr, "create d%d/%s failed\n", i / FILES_PER_DIR, name);
+            return 1;
+        }
+    }
+    double create_time = now() - start;
+
+    // Look the files up in a scattered order, each in its directory as the
+    // kernel would once it has the directory.
+    start = now();
+    for (int n = 0, i = 0; n < count; n++, i = (i + 7919) % count) {
+        snprintf(name, sizeof(name), "f%d", i % FILES_PER_DIR);
+        if (node_lookup(dirs[i / FILES_PER_DIR], name, &st) < 0) {
+            fprintf(stderr, "lookup d%d/%s failed\n", i / FILES_PER_DIR, name);
+            return 1;
+        }
+    }
+    double lookup_time = now() - start;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(stderr, "%10d inodes: create %9.0f/s  lookup %9.0f/s  peak RSS %6ld MiB\n",
+            count, (count + num_dirs) / create_time, count / lookup_time, usage.ru_maxrss / 1024);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    static const int default_counts[] = { 10000, 1000000, 10000000 };
+    int num_counts = argc > 1 ? argc - 1 : 3;
+
+    for (int c = 0; c < num_counts; c++) {
+        int count = argc > 1 ? atoi(argv[c + 1]) : default_counts[c];
+        if (count <= 0) {
+            fprintf(stderr, "bad count %s\n", argv[c + 1]);
+            return 1;
+        }
+
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) _exit(run(count));
+
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "%10d inodes: failed\n", count);
+            return 1;
+        }
+    }
+    return 0;
+}
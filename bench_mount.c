@@ -0,0 +1,156 @@
+// Time to mount (load the image) and peak memory.
+//
+//   ./bench_mount [MiB ...]     default: 128 512
+//
+// For each size, an image of about that many MiB is generated in /tmp:
+// directories of FILES_PER_DIR regular files with FILE_SIZE bytes of
+// text each. It is then loaded with 1, 2, 4 and 8 loader threads, and
+// finally converted to a binary image and mounted from that, each time in
+// a separate process, so every run starts with a fresh heap and its own
+// peak RSS.
+#define main jsonfs_main
+#include "jsonfs.c"
+#undef main
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FILES_PER_DIR 1000
+#define FILE_SIZE 4096
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Write an image with num_files files and return its size in bytes.
+static long write_image(const char *path, int num_files) {
+    FILE *f = fopen(path, "w");
+    if (!f) return -1;
+
+    // Lines of text with an escaped newline and quote, as json-c writes them.
+    char data[FILE_SIZE * 2];
+    size_t len = 0;
+    for (int i = 0; len < FILE_SIZE - 64; i++) {
+        len += sprintf(data + len, "line %d of \\\"sample\\\" text\\n", i);
+    }
+
+    int num_dirs = (num_files + FILES_PER_DIR - 1) / FILES_PER_DIR;
+    int first_file = 1 + num_dirs;
+    fprintf(f, "[\n  {\n    \"inode\": 0,\n    \"type\": \"dir\",\n    \"entries\": [\n");
+    for (int d = 0; d < num_dirs; d++) {
+        fprintf(f, "      {\n        \"name\": \"d%d\",\n        \"inode\": %d\n      }%s\n", d, 1 + d, d + 1 < num_dirs ? "," : "");
+    }
+    fprintf(f, "    ]\n  }");
+    for (int d = 0; d < num_dirs; d++) {
+        fprintf(f, ",\n  {\n    \"inode\": %d,\n    \"type\": \"dir\",\n    \"entries\": [\n", 1 + d);
+        for (int i = d * FILES_PER_DIR; i < num_files && i < (d + 1) * FILES_PER_DIR; i++) {
+            bool last = i + 1 == num_files || i + 1 == (d + 1) * FILES_PER_DIR;
+            fprintf(f, "      {\n        \"name\": \"f%d\",\n        \"inode\": %d\n      }%s\n", i, first_file + i, last ? "" : ",");
+        }
+        fprintf(f, "    ]\n  }");
+    }
+    for (int i = 0; i < num_files; i++) {
+        fprintf(f, ",\n  {\n    \"inode\": %d,\n    \"type\": \"reg\",\n    \"data\": \"%.*s\"\n  }", first_file + i, (int)len, data);
+    }
+    fprintf(f, "\n]\n");
+
+    long size = ftell(f);
+    return fclose(f) == 0 ? size : -1;
+}
+
+static const int thread_counts[] = { 1, 2, 4, 8 };
+
+// threads 0 converts the JSON image to a binary one at binary_image
+// instead, -1 mounts that.
+static int run(const char *image, const char *binary_image, int num_files, int threads) {
+    max_inodes = num_files + num_files / FILES_PER_DIR + 2;
+    load_threads = threads;
+
+    if (threads == 0) {
+        load_json_fs(image);
+        return store_binary_image(binary_image) != 0;
+    }
+
+    double start = now();
+    if (threads < 0) {
+        load_binary_image(binary_image);
+    } else {
+        load_json_fs(image);
+    }
+    double elapsed = now() - start;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    if (threads < 0) {
+        fprintf(stderr, "  binary:    mounted %d objects in %.3f s, peak RSS %ld MiB\n",
+                num_fs_objects, elapsed, usage.ru_maxrss / 1024);
+    } else {
+        fprintf(stderr, "  %d thread%s: mounted %d objects in %.2f s, peak RSS %ld MiB\n",
+                threads, threads == 1 ? " " : "s", num_fs_objects, elapsed, usage.ru_maxrss / 1024);
+    }
+    return 0;
+}
+
+static int run_in_child(const char *image, const char *binary_image, int num_files, int threads) {
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) _exit(run(image, binary_image, num_files, threads));
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "  failed\n");
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    static const int default_sizes[] = { 128, 512 };
+    int num_sizes = argc > 1 ? argc - 1 : 2;
+
+    for (int i = 0; i < num_sizes; i++) {
+        int mib = argc > 1 ? atoi(argv[i + 1]) : default_sizes[i];
+        if (mib <= 0) {
+            fprintf(stderr, "bad size %s\n", argv[i + 1]);
+            return 1;
+        }
+
+        char image[] = "/tmp/bench_mount.XXXXXX";
+        int fd = mkstemp(image);
+        if (fd < 0) {
+            perror("mkstemp");
+            return 1;
+        }
+        close(fd);
+        int num_files = (int)((long)mib * 1024 * 1024 / (FILE_SIZE + 128));
+        long size = write_image(image, num_files);
+        if (size < 0) {
+            perror(image);
+            unlink(image);
+            return 1;
+        }
+        fprintf(stderr, "%ld MiB image, %d files:\n", size >> 20, num_files);
+
+        char binary_image[sizeof(image) + 4];
+        snprintf(binary_image, sizeof(binary_image), "%s.img", image);
+        int res = 0;
+        for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]) && res == 0; t++) {
+            res = run_in_child(image, binary_image, num_files, thread_counts[t]);
+        }
+        if (res == 0) res = run_in_child(image, binary_image, num_files, 0);
+        if (res == 0) res = run_in_child(image, binary_image, num_files, -1);
+        unlink(image);
+        unlink(binary_image);
+        if (res != 0) return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,138 @@
+// Throughput of saving the file system as JSON, and as a binary image for
+// comparison.
+//
+//   ./bench_save [MiB ...]     default: 128 512
+//
+// For each size, a file system of about that many MiB is built in memory:
+// directories of FILES_PER_DIR regular files with FILE_SIZE bytes of text
+// each. It is then saved as compact JSON with 1, 2, 4 and 8 threads, as
+// pretty JSON, and as a binary image, to a file in /tmp. Throughput is the
+// size of the written file over the time to write and sync it. The
+// operations behind the FUSE callbacks are called directly.
+#define main jsonfs_main
+#include "jsonfs.c"
+#undef main
+
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FILES_PER_DIR 1000
+#define FILE_SIZE 4096
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const int thread_counts[] = { 1, 2, 4, 8 };
+
+static int build(int num_files) {
+    char image[] = "/tmp/bench_save.XXXXXX";
+    int fd = mkstemp(image);
+    if (fd < 0) {
+        perror("mkstemp");
+        return -1;
+    }
+    dprintf(fd, "[ { \"inode\": 0, \"type\": \"dir\", \"entries\": [ ] } ]\n");
+    close(fd);
+    int num_dirs = (num_files + FILES_PER_DIR - 1) / FILES_PER_DIR;
+    max_inodes = num_files + num_dirs + 1;
+    load_json_fs(image);
+    unlink(image);
+
+    // Lines of text with a newline and quotes, which JSON escapes.
+    char data[FILE_SIZE];
+    size_t len = 0;
+    for (int i = 0; len < FILE_SIZE - 64; i++) {
+        len += sprintf(data + len, "line %d of \"sample\" text\n", i);
+    }
+
+    struct stat st;
+    char name[32];
+    int dir = -1;
+    for (int i = 0; i < num_files; i++) {
+        if (i % FILES_PER_DIR == 0) {
+            snprintf(name, sizeof(name), "d%d", i / FILES_PER_DIR);
+            if ((dir = node_create(0, name, FS_DIR, &st)) < 0) return -1;
+        }
+        snprintf(name, sizeof(name), "f%d", i % FILES_PER_DIR);
+        int inode = node_create(dir, name, FS_REG, &st);
+        if (inode < 0 || node_write(inode, data, len, 0) != (int)len) {
+            fprintf(stderr, "create d%d/%s failed\n", i / FILES_PER_DIR, name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Save in the given way and print the throughput. threads 0 writes a
+// binary image instead.
+static int save(const char *what, int threads, bool pretty) {
+    char out[] = "/tmp/bench_save.out.XXXXXX";
+    int fd = mkstemp(out);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    save_threads = threads;
+    json_pretty = pretty;
+    double start = now();
+    snapshot *s = snapshot_take();
+    int res = !s ? -ENOMEM : threads > 0 ? store_snapshot_json(s, out, NULL) : store_snapshot_binary(s, out, NULL);
+    snapshot_release(s);
+    double elapsed = now() - start;
+
+    struct stat st;
+    if (res == 0 && stat(out, &st) == 0) {
+        fprintf(stderr, "  %-18s %7.1f MB in %6.3f s: %6.0f MB/s\n", what, st.st_size / 1e6, elapsed, st.st_size / 1e6 / elapsed);
+    }
+    unlink(out);
+    return res != 0;
+}
+
+static int run(int num_files) {
+    if (build(num_files) != 0) return 1;
+
+    char what[32];
+    for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+        snprintf(what, sizeof(what), "compact, %d thread%s", thread_counts[t], thread_counts[t] == 1 ? "" : "s");
+        if (save(what, thread_counts[t], false) != 0) return 1;
+    }
+    if (save("pretty, 8 threads", 8, true) != 0) return 1;
+    return save("binary", 0, false);
+}
+
+int main(int argc, char *argv[]) {
+    static const int default_sizes[] = { 128, 512 };
+    int num_sizes = argc > 1 ? argc - 1 : 2;
+
+    for (int i = 0; i < num_sizes; i++) {
+        int mib = argc > 1 ? atoi(argv[i + 1]) : default_sizes[i];
+        if (mib <= 0) {
+            fprintf(stderr, "bad size %s\n", argv[i + 1]);
+            return 1;
+        }
+        int num_files = (int)((long)mib * 1024 * 1024 / FILE_SIZE);
+        fprintf(stderr, "%d MiB of data, %d files:\n", mib, num_files);
+
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) _exit(run(num_files));
+
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "  failed\n");
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -1,2 +1,7 @@
 set -x
-gcc -Wall jsonfs.c $(pkg-config fuse json-c --cflags --libs) -o fuse_example
+gcc -Wall jsonfs.c $(pkg-config fuse --cflags --libs) -o fuse_example
+gcc -Wall -DFUSE_USE_VERSION=31 jsonfs.c $(pkg-config fuse3 --cflags --libs) -o fuse_example3
+gcc -Wall -O2 bench_inodes.c $(pkg-config fuse --cflags --libs) -o bench_inodes
+gcc -Wall -O2 bench_mount.c $(pkg-config fuse --cflags --libs) -o bench_mount
+gcc -Wall -O2 bench_fsync.c $(pkg-config fuse --cflags --libs) -o bench_fsync
+gcc -Wall -O2 bench_save.c $(pkg-config fuse --cflags --libs) -o bench_save
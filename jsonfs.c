@@ -1,627 +1,5329 @@
+// libfuse 2 by default. build.sh also builds fuse_example3 against
+// libfuse 3 with -DFUSE_USE_VERSION=31.
+#ifndef FUSE_USE_VERSION
 #define FUSE_USE_VERSION 26
+#endif
+#define _GNU_SOURCE  // pthread_rwlockattr_setkind_np
 
 #include <stdbool.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <json-c/json.h>
 #include <libgen.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
-#define MAX_TEXT_SIZE 4096
-#define MAX_ENTRIES_PER_DIR 16
-#define MAX_FILES 128
+// Quotas, changed with -o max_inodes=N and -o max_dir_entries=N. Inode
+// numbers run from 0 to max_inodes - 1.
+#define DEFAULT_MAX_INODES (1 << 20)
+#define DEFAULT_MAX_DIR_ENTRIES (1 << 16)
+static int max_inodes = DEFAULT_MAX_INODES;
+static int max_dir_entries = DEFAULT_MAX_DIR_ENTRIES;
 
-#define MAX_FS_OBJECTS 4096
-int max_fs_objects = 4096;
-// We will use a dynamic array to hold our free inodes.
-int *free_inodes = NULL;
-int num_free_inodes = 0;
-
-static int num_fs_objects;
+static int num_fs_objects;  // high-water mark: slots [0, num_fs_objects) have been used
 
+// Locking rules:
+//
+// - Every fs_object has a reader/writer lock. For a regular file it protects
+//   the data and size; for a directory it protects the entry list. It also
+//   guards type and nlink, so an inode is freed under its own write lock.
+// - fs_mutex only protects inode allocation (num_fs_objects and the inode
+//   bitmap) and loading the image. It is a leaf lock: nothing else is taken
+//   while it is held.
+// - Name lookups (dir_lookup_cached) take no directory locks at all. They
+//   walk hash tables that writers publish atomically and reclaim through
+//   epochs, and the negative cache is atomic slots validated against the
+//   parent directory's version. node_lookup then locks only the inode it
+//   found.
+// - Operations that lock more than one inode take the parent directory
+//   before the child (create, mkdir, unlink, rmdir). An operation that
+//   needs two unrelated directories (rename) locks them in ascending inode
+//   order before locking any child. Inode numbers are reused, so a slot
+//   that was a parent earlier may be a child now; that is fine because a
+//   freshly allocated object is unreachable, and whoever holds its lock
+//   (a stale lookup about to find it FS_FREE) takes no other lock.
+// - data_cache_mutex guards the list of files loaded on demand from the
+//   image. It is taken under an inode's write lock; while holding it, the
+//   evictor only ever trylocks other inodes.
+// - journal_mutex guards the journal buffer and is taken last; a commit
+//   does its I/O without it.
+// - change_lock is taken shared before any other lock by operations that
+//   change the file system, and exclusively to take a snapshot between two
+//   of them. snapshot_mutex is taken under an inode's write lock while the
+//   inode is preserved for snapshots (snapshot_preserve).
 pthread_mutex_t fs_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-void add_free_inode(int inode) {
-    // Increase the size of the free_inodes array.
-    free_inodes = realloc(free_inodes, (num_free_inodes + 1) * sizeof(int));
-    // Add the inode to the end of the array.
-    free_inodes[num_free_inodes] = inode;
-    num_free_inodes++;
+// Free inode bitmap: bit i of inode_map is set while slot i is free. Each
+// bit of inode_summary stands for one word of inode_map and is set while
+// that word has a free slot, so finding the lowest free inode takes two
+// find-first-set operations after a scan of the summary that starts at
+// inode_summary_hint, the first summary word that may have a free slot.
+// Handing out the lowest free number keeps the used part of the table
+// dense. Protected by fs_mutex.
+static uint64_t *inode_map;
+static uint64_t *inode_summary;
+static size_t inode_map_words, inode_summary_words;
+static size_t inode_summary_hint;
+
+// Mark every slot of a table with num_slots entries free.
+static int inode_map_init(int num_slots) {
+    free(inode_map);
+    free(inode_summary);
+    inode_map_words = ((size_t)num_slots + 63) / 64;
+    inode_summary_words = (inode_map_words + 63) / 64;
+    inode_map = malloc(inode_map_words * sizeof(uint64_t));
+    inode_summary = calloc(inode_summary_words, sizeof(uint64_t));
+    if (!inode_map || !inode_summary) return -ENOMEM;
+
+    memset(inode_map, 0xff, inode_map_words * sizeof(uint64_t));
+    if (num_slots % 64) inode_map[inode_map_words - 1] = ((uint64_t)1 << (num_slots % 64)) - 1;
+    for (size_t w = 0; w < inode_map_words; w++) {
+        inode_summary[w / 64] |= (uint64_t)1 << (w % 64);
+    }
+    inode_summary_hint = 0;
+    return 0;
+}
+
+static void inode_map_take(int inode) {
+    size_t w = inode / 64;
+    inode_map[w] &= ~((uint64_t)1 << (inode % 64));
+    if (!inode_map[w]) inode_summary[w / 64] &= ~((uint64_t)1 << (w % 64));
 }
 
-int get_free_inode() {
-    if (num_free_inodes == 0) {
-        // If there are no free inodes, we just use the next available number.
-        return num_fs_objects++;
-    } else {
-        // Otherwise, we remove the last element from the free_inodes array and return it.
-        int inode = free_inodes[num_free_inodes - 1];
-        free_inodes = realloc(free_inodes, (num_free_inodes - 1) * sizeof(int));
-        num_free_inodes--;
-        return inode;
+static void inode_map_put(int inode) {
+    size_t w = inode / 64;
+    inode_map[w] |= (uint64_t)1 << (inode % 64);
+    inode_summary[w / 64] |= (uint64_t)1 << (w % 64);
+    if (w / 64 < inode_summary_hint) inode_summary_hint = w / 64;
+}
+
+// Lowest free inode, or -1 if the table is full.
+static int inode_map_find(void) {
+    for (size_t s = inode_summary_hint; s < inode_summary_words; s++) {
+        if (inode_summary[s]) {
+            inode_summary_hint = s;
+            size_t w = s * 64 + __builtin_ctzll(inode_summary[s]);
+            return (int)(w * 64 + __builtin_ctzll(inode_map[w]));
+        }
     }
+    inode_summary_hint = inode_summary_words;
+    return -1;
 }
 
 
+// Small-object pool for dentries, lookup cache entries, directory headers
+// and epoch bookkeeping: everything that create, unlink and lookup
+// allocate and free by the thousand. Objects are rounded up to one of a few
+// size classes and carved out of POOL_BLOCK_SIZE blocks, so a metadata
+// storm doesn't go through malloc and objects of one class don't fragment
+// the heap for the others. Blocks are aligned to their size and start with
+// a header naming the class, so pool_free needs only the pointer and can
+// be handed to epoch_retire. Objects too big for any class get a block of
+// their own.
+//
+// Each thread keeps up to POOL_CACHE_MAX free objects per class and only
+// takes the class lock to trade half a cache's worth with the shared free
+// list. Pool locks are leaves. Blocks are never given back to the system.
+#define POOL_BLOCK_SIZE ((size_t)64 * 1024)
+#define POOL_HEADER_SIZE 64
+#define POOL_CACHE_MAX 64
+#define POOL_LARGE (-1)
+
+static const size_t pool_class_size[] = { 32, 48, 64, 96, 128, 192, 256, 384 };
+#define POOL_NUM_CLASSES ((int)(sizeof(pool_class_size) / sizeof(pool_class_size[0])))
+
+typedef struct pool_object {
+    struct pool_object *next;
+} pool_object;
+
 typedef struct {
-    int inode;
-    const char *type;
-    char *name;
-    char *data;
-    struct json_object *entries;
-} fs_object;
+    int size_class;  // POOL_LARGE for a single oversized object
+} pool_block;
 
-static fs_object *fs_objects;
+static struct {
+    pthread_mutex_t lock;
+    pool_object *free;   // shared free list
+    char *carve;         // unused part of the newest block
+    char *carve_end;
+} pool_classes[POOL_NUM_CLASSES];
 
-void print_fs_object(const fs_object *obj) {
-    printf("fs_object: inode=%d, type=%s, name=%s, data=%s\n",
-           obj->inode, obj->type ? obj->type : "Unknown", obj->name ? obj->name : "Unknown",
-           obj->data ? obj->data : "Unknown");
-}
+typedef struct {
+    pool_object *head;
+    int count;
+} pool_cache;
 
+static __thread pool_cache pool_caches[POOL_NUM_CLASSES];
+static __thread bool pool_registered;
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
 
-static void load_json_fs(const char *filename) {
-    struct json_object *fs_json = json_object_from_file(filename);
-    if (!fs_json) {
-        fprintf(stderr, "Failed to load JSON filesystem from %s\n", filename);
-        exit(1);
-    }
+static void pool_flush(pool_cache *cache, int size_class, int keep) {
+    if (cache->count <= keep) return;
 
-    num_fs_objects = json_object_array_length(fs_json);
-    if(num_fs_objects > MAX_FILES){
-        fprintf(stderr, "Too many files in the system\n");
-        exit(1);
+    // Detach everything past the first `keep` objects.
+    pool_object *first = cache->head, *last;
+    if (keep == 0) {
+        cache->head = NULL;
+    } else {
+        pool_object *tail = cache->head;
+        for (int i = 1; i < keep; i++) tail = tail->next;
+        first = tail->next;
+        tail->next = NULL;
     }
-    
-    fs_objects = calloc(num_fs_objects, sizeof(fs_object));
-    for (int i = 0; i < num_fs_objects; i++) {
-        struct json_object *obj = json_object_array_get_idx(fs_json, i);
-        struct json_object *tmp;
-
-        if (json_object_object_get_ex(obj, "inode", &tmp))
-            fs_objects[i].inode = json_object_get_int(tmp);
-        if (json_object_object_get_ex(obj, "type", &tmp))
-            fs_objects[i].type = json_object_get_string(tmp);
-        if (json_object_object_get_ex(obj, "name", &tmp)) {
-            const char *name = json_object_get_string(tmp);
-            fs_objects[i].name = strdup(name);
-        }
-        if (json_object_object_get_ex(obj, "data", &tmp)) {
-            const char *data = json_object_get_string(tmp);
-            if(strlen(data) > MAX_TEXT_SIZE){
-                fprintf(stderr, "File content size exceeds limit\n");
-                exit(1);
-            }
-            fs_objects[i].data = strdup(data);
-        } else {
-            fs_objects[i].data = NULL;
-        }
-        if (json_object_object_get_ex(obj, "entries", &tmp)){
-            fs_objects[i].entries = tmp;
-            if(json_object_array_length(tmp) > MAX_ENTRIES_PER_DIR){
-                fprintf(stderr, "Too many files in a directory\n");
-                exit(1);
-            }
-        }
+    for (last = first; last->next; last = last->next)
+        ;
+    cache->count = keep;
+
+    pthread_mutex_lock(&pool_classes[size_class].lock);
+    last->next = pool_classes[size_class].free;
+    pool_classes[size_class].free = first;
+    pthread_mutex_unlock(&pool_classes[size_class].lock);
+}
 
-        print_fs_object(&fs_objects[i]);
+// Hand an exiting thread's cached objects back to the shared lists.
+static void pool_thread_exit(void *arg) {
+    (void) arg;
+    pool_registered = false;  // a later free registers again
+    for (int c = 0; c < POOL_NUM_CLASSES; c++) {
+        pool_flush(&pool_caches[c], c, 0);
     }
 }
 
-void initialize_file_system(const char *json_file) {
-	pthread_mutex_lock(&fs_mutex);
-    struct json_object *root_obj = json_object_from_file(json_file);
-    if (!root_obj) {
-        printf("Failed to load file system from %s\n", json_file);
-        exit(1);
+static void pool_init(void) {
+    for (int c = 0; c < POOL_NUM_CLASSES; c++) {
+        pthread_mutex_init(&pool_classes[c].lock, NULL);
     }
+    pthread_key_create(&pool_key, pool_thread_exit);
+}
 
-    int array_length = json_object_array_length(root_obj);
-
-    for (int i = 0; i < array_length; i++) {
-        struct json_object *fs_object_json = json_object_array_get_idx(root_obj, i);
-
-        struct json_object *inode_obj;
-        struct json_object *type_obj;
-        struct json_object *name_obj;
-        struct json_object *data_obj;
-        struct json_object *entries_obj;
-
-        json_object_object_get_ex(fs_object_json, "inode", &inode_obj);
-        json_object_object_get_ex(fs_object_json, "type", &type_obj);
-        json_object_object_get_ex(fs_object_json, "name", &name_obj);
-        json_object_object_get_ex(fs_object_json, "data", &data_obj);
-        json_object_object_get_ex(fs_object_json, "entries", &entries_obj);
-
-        fs_objects[i].inode = json_object_get_int(inode_obj);
-        fs_objects[i].type = strdup(json_object_get_string(type_obj));
-        fs_objects[i].name = name_obj ? strdup(json_object_get_string(name_obj)) : NULL;
-        fs_objects[i].data = data_obj ? strdup(json_object_get_string(data_obj)) : NULL;
-        fs_objects[i].entries = entries_obj ? json_object_get(entries_obj) : NULL;
-    }
-	pthread_mutex_unlock(&fs_mutex);
-    json_object_put(root_obj);
-}
-
-void store_file_system(char *json_file) {
-	pthread_mutex_lock(&fs_mutex);
-    // Initialize a new JSON array object
-    struct json_object *root_obj = json_object_new_array();
-    
-    // Iterate over all fs_objects
-    for (int i = 0; i < MAX_FS_OBJECTS; i++) {
-        // Check if the fs_object is in use (type is not NULL)
-        if (fs_objects[i].type != NULL) {
-            struct json_object *fs_obj = json_object_new_object();
-
-            // Add other fields...
-            json_object_object_add(fs_obj, "inode", json_object_new_int(fs_objects[i].inode));
-            json_object_object_add(fs_obj, "type", json_object_new_string(fs_objects[i].type));
-            json_object_object_add(fs_obj, "name", json_object_new_string(fs_objects[i].name));
-
-            // If it's a regular file, add data
-            if(strcmp(fs_objects[i].type, "reg") == 0) {
-                json_object_object_add(fs_obj, "data", json_object_new_string(fs_objects[i].data));
-            }
+// This thread's cache for size_class. Registers the thread on first use,
+// whether it allocates or only frees, so that its cache is handed back when
+// it exits.
+static pool_cache *pool_thread_cache(int size_class) {
+    if (!pool_registered) {
+        pthread_once(&pool_once, pool_init);
+        pthread_setspecific(pool_key, pool_caches);  // run pool_thread_exit for this thread
+        pool_registered = true;
+    }
+    return &pool_caches[size_class];
+}
 
-            // If it's a directory, add entries
-            if(strcmp(fs_objects[i].type, "dir") == 0) {
-                struct json_object *entry_list = fs_objects[i].entries;
-                json_object_object_add(fs_obj, "entries", json_object_get(entry_list)); // Increments the reference count of entry_list
-            }
+// Refill an empty cache with up to POOL_CACHE_MAX / 2 objects.
+static int pool_refill(pool_cache *cache, int size_class) {
+    size_t size = pool_class_size[size_class];
+    int want = POOL_CACHE_MAX / 2;
 
-            json_object_array_add(root_obj, fs_obj);
+    pthread_mutex_lock(&pool_classes[size_class].lock);
+    while (cache->count < want && pool_classes[size_class].free) {
+        pool_object *obj = pool_classes[size_class].free;
+        pool_classes[size_class].free = obj->next;
+        obj->next = cache->head;
+        cache->head = obj;
+        cache->count++;
+    }
+    while (cache->count < want) {
+        if (pool_classes[size_class].carve + size > pool_classes[size_class].carve_end) {
+            pool_block *block = aligned_alloc(POOL_BLOCK_SIZE, POOL_BLOCK_SIZE);
+            if (!block) break;
+            block->size_class = size_class;
+            pool_classes[size_class].carve = (char *)block + POOL_HEADER_SIZE;
+            pool_classes[size_class].carve_end = (char *)block + POOL_BLOCK_SIZE;
         }
+        pool_object *obj = (pool_object *)pool_classes[size_class].carve;
+        pool_classes[size_class].carve += size;
+        obj->next = cache->head;
+        cache->head = obj;
+        cache->count++;
+    }
+    pthread_mutex_unlock(&pool_classes[size_class].lock);
+    return cache->count > 0 ? 0 : -ENOMEM;
+}
+
+static void *pool_alloc(size_t size) {
+    int size_class = 0;
+    while (size_class < POOL_NUM_CLASSES && pool_class_size[size_class] < size) {
+        size_class++;
     }
-    
-    // Write the root_obj to the JSON file
-    if (json_object_to_file_ext(json_file, root_obj, JSON_C_TO_STRING_PRETTY) != 0) {
-        fprintf(stderr, "Failed to write JSON file: %s\n", json_file);
+    if (size_class == POOL_NUM_CLASSES) {
+        size_t block_size = (POOL_HEADER_SIZE + size + POOL_BLOCK_SIZE - 1) & ~(POOL_BLOCK_SIZE - 1);
+        pool_block *block = aligned_alloc(POOL_BLOCK_SIZE, block_size);
+        if (!block) return NULL;
+        block->size_class = POOL_LARGE;
+        return (char *)block + POOL_HEADER_SIZE;
     }
 
-	pthread_mutex_unlock(&fs_mutex);
-    // Decrement the reference count of root_obj to free it
-    json_object_put(root_obj);
+    pool_cache *cache = pool_thread_cache(size_class);
+    if (!cache->head && pool_refill(cache, size_class) != 0) return NULL;
+    pool_object *obj = cache->head;
+    cache->head = obj->next;
+    cache->count--;
+    return obj;
 }
 
-static void *fuse_example_init(struct fuse_conn_info *conn) {
-    (void) conn;
-    initialize_file_system("fs.json");
-    return NULL;
+static void pool_free(void *ptr) {
+    if (!ptr) return;
+    pool_block *block = (pool_block *)((uintptr_t)ptr & ~(uintptr_t)(POOL_BLOCK_SIZE - 1));
+    if (block->size_class == POOL_LARGE) {
+        free(block);
+        return;
+    }
+
+    pool_cache *cache = pool_thread_cache(block->size_class);
+    pool_object *obj = ptr;
+    obj->next = cache->head;
+    cache->head = obj;
+    if (++cache->count > POOL_CACHE_MAX) {
+        pool_flush(cache, block->size_class, POOL_CACHE_MAX / 2);
+    }
+}
+
+// Epoch-based reclamation for structures that path lookups read without
+// locks (directory hash chains and tables, rmdir'd directories, lookup cache
+// entries). A reader brackets its accesses with epoch_enter/epoch_exit.
+// Writers unlink an object first and then hand it to epoch_retire, which
+// frees it once every thread that might still see it has left its epoch:
+// an object retired in epoch e is freed when the global epoch reaches e + 2.
+#define EPOCH_RETIRE_BATCH 64
+
+typedef struct epoch_record {
+    _Atomic unsigned long state;  // (epoch << 1) | 1 while inside, 0 outside
+    atomic_bool in_use;           // owned by a live thread
+    struct epoch_record *next;
+} epoch_record;
+
+typedef struct retired_object {
+    struct retired_object *next;
+    void *ptr;
+    void (*free_fn)(void *);
+    unsigned long epoch;
+} retired_object;
+
+static _Atomic unsigned long global_epoch = 1;
+static _Atomic(epoch_record *) epoch_records;
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_key_once = PTHREAD_ONCE_INIT;
+static __thread epoch_record *epoch_self;
+static __thread int epoch_depth;
+
+static pthread_mutex_t retire_mutex = PTHREAD_MUTEX_INITIALIZER;
+static retired_object *retired_list;
+static int num_retired;
+
+static void epoch_thread_exit(void *arg) {
+    epoch_record *rec = arg;
+    atomic_store_explicit(&rec->state, 0, memory_order_release);
+    atomic_store_explicit(&rec->in_use, false, memory_order_release);
 }
 
-static void fuse_example_destroy(void *private_data) {
-    (void) private_data;
-    store_file_system("fs_edited.json");
+static void epoch_make_key(void) {
+    pthread_key_create(&epoch_key, epoch_thread_exit);
 }
 
-static int lookup_inode(const char *path) {
-    char *path_copy = strdup(path);
-	if(!path_copy) {
-		return -ENOMEM;
-	}
+// Find this thread's record, reusing one left behind by an exited thread.
+static epoch_record *epoch_register(void) {
+    pthread_once(&epoch_key_once, epoch_make_key);
 
-    char *seg = strtok(path_copy, "/");
-    int inode = 0;  // root directory
+    epoch_record *rec;
+    for (rec = atomic_load(&epoch_records); rec; rec = rec->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&rec->in_use, &expected, true)) break;
+    }
+    if (!rec) {
+        rec = calloc(1, sizeof(epoch_record));
+        if (!rec) {
+            fprintf(stderr, "Failed to allocate epoch record\n");
+            exit(1);
+        }
+        atomic_init(&rec->in_use, true);
+        rec->next = atomic_load(&epoch_records);
+        while (!atomic_compare_exchange_weak(&epoch_records, &rec->next, rec))
+            ;
+    }
+    pthread_setspecific(epoch_key, rec);
+    return rec;
+}
 
-    while (seg != NULL) {
-        bool found = false;
-        const fs_object *dir_obj = &fs_objects[inode];
-        int entries_length = json_object_array_length(dir_obj->entries);
-        for (int i = 0; i < entries_length; i++) {
-            struct json_object *entry_obj = json_object_array_get_idx(dir_obj->entries, i);
-            struct json_object *name_obj, *inode_obj;
+static void epoch_enter(void) {
+    if (epoch_depth++ > 0) return;  // already inside
+    if (!epoch_self) epoch_self = epoch_register();
 
-            if (json_object_object_get_ex(entry_obj, "name", &name_obj) && json_object_object_get_ex(entry_obj, "inode", &inode_obj)) {
-                const char *name = json_object_get_string(name_obj);
-                if (strcmp(name, seg) == 0) {
-                    inode = json_object_get_int(inode_obj);
-                    found = true;
-                    break;
-                }
-            }
+    unsigned long epoch = atomic_load(&global_epoch);
+    atomic_store_explicit(&epoch_self->state, (epoch << 1) | 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+static void epoch_exit(void) {
+    if (--epoch_depth > 0) return;
+    atomic_store_explicit(&epoch_self->state, 0, memory_order_release);
+}
+
+// Advance the global epoch if every thread inside an epoch has seen the
+// current one, then free whatever is two epochs old. Called with
+// retire_mutex held.
+static void epoch_collect(void) {
+    unsigned long epoch = atomic_load(&global_epoch);
+    bool can_advance = true;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    for (epoch_record *rec = atomic_load(&epoch_records); rec; rec = rec->next) {
+        unsigned long state = atomic_load(&rec->state);
+        if ((state & 1) && (state >> 1) != epoch) {
+            can_advance = false;
+            break;
         }
+    }
+    if (can_advance) {
+        atomic_store(&global_epoch, ++epoch);
+    }
 
-        if (!found) {
-            free(path_copy);
-            return -1;  // inode not found
+    retired_object **link = &retired_list;
+    while (*link) {
+        retired_object *r = *link;
+        if (r->epoch + 2 <= epoch) {
+            *link = r->next;
+            r->free_fn(r->ptr);
+            pool_free(r);
+            num_retired--;
+        } else {
+            link = &r->next;
         }
+    }
+}
 
-        seg = strtok(NULL, "/");
+static void epoch_retire(void *ptr, void (*free_fn)(void *)) {
+    retired_object *r = pool_alloc(sizeof(retired_object));
+    if (!r) {
+        // Can't defer the free; leaking is safer than freeing under readers.
+        return;
     }
+    r->ptr = ptr;
+    r->free_fn = free_fn;
 
-    free(path_copy);
-    return inode;
+    pthread_mutex_lock(&retire_mutex);
+    r->epoch = atomic_load(&global_epoch);
+    r->next = retired_list;
+    retired_list = r;
+    if (++num_retired >= EPOCH_RETIRE_BATCH) {
+        epoch_collect();
+    }
+    pthread_mutex_unlock(&retire_mutex);
 }
 
+// The in-memory file system is a native inode table indexed by inode number.
+// JSON is only touched when the image is loaded and when it is stored; the
+// FUSE callbacks work on these structures alone.
+typedef enum {
+    FS_FREE = 0,  // unused slot
+    FS_REG,
+    FS_DIR,
+} fs_type;
 
-static int fuse_example_open(const char *path, struct fuse_file_info *fi) {
-    int inode = lookup_inode(path);
-    if (inode < 0) return -ENOENT;  // No such file or directory
+// A directory entry. Entries are chained into the directory's hash buckets
+// for lookup and also kept in listing order for readdir. Immutable once
+// published. The name is stored inline, so an entry is a single allocation.
+typedef struct fs_dentry {
+    _Atomic(struct fs_dentry *) next;  // hash chain
+    unsigned int hash;
+    int inode;
+    off_t cookie;                      // readdir offset, unique within the directory
+    char name[];
+} fs_dentry;
 
-//    if ((fi->flags & 3) != O_RDONLY) {
-//        return -EACCES;  // Access denied
-//    }
+#define DIR_MIN_BUCKETS 16
 
-    return 0;
+typedef struct {
+    unsigned int num_buckets;  // always a power of two
+    _Atomic(fs_dentry *) heads[];
+} fs_dir_table;
+
+// The listing is a sequence of chunks holding up to DIR_CHUNK_ENTRIES
+// entries each, sorted by cookie. Every entry gets the next cookie when it
+// is added, so new entries go at the end of the last chunk and a readdir
+// offset stays meaningful however the directory changes: listing resumes
+// at the first cookie past it, found by binary search. Offsets 1 and 2
+// are "." and "..".
+#define DIR_CHUNK_ENTRIES 128
+#define DIR_FIRST_COOKIE 3
+
+typedef struct {
+    int count;
+    fs_dentry *entries[DIR_CHUNK_ENTRIES];
+} fs_dir_chunk;
+
+// Path lookups walk the hash table without taking the directory lock, so
+// writers (who hold it) publish changes with release stores and retire
+// anything they unlink through epoch_retire. The listing is only used by
+// writers and readdir, both under the lock.
+typedef struct {
+    _Atomic(fs_dir_table *) table;
+    fs_dir_chunk **chunks;     // listing order
+    int num_chunks;
+    int max_chunks;
+    int num_entries;
+    off_t next_cookie;
+} fs_dir;
+
+// Regular files up to this many bytes live inside their fs_object.
+#define INLINE_DATA_SIZE 48
+
+// A run of a regular file's bytes stored in a binary image: len bytes at
+// offset in the file are at start in the image's data region. Offsets are
+// multiples of CHUNK_SIZE; whatever no extent covers is a hole.
+typedef struct {
+    uint64_t offset;
+    uint64_t len;
+    uint64_t start;
+} file_extent;
+
+typedef struct fs_object {
+    pthread_rwlock_t lock;  // see the locking rules above
+    int inode;
+    fs_type type;
+    int nlink;      // number of directory entries pointing here
+    size_t size;              // length of data for regular files
+    char *name;               // optional "name" carried through from the image
+    // FS_REG data. Small files keep their bytes in inline_data inside the
+    // record; the first write past INLINE_DATA_SIZE spills them into chunks.
+    bool data_inline;
+    union {
+        struct {
+            char **chunks;            // split into CHUNK_SIZE pieces
+            size_t max_chunks;        // slots allocated in chunks
+            size_t first_chunk_size;  // bytes allocated for chunks[0]
+        };
+        char inline_data[INLINE_DATA_SIZE];
+    };
+    size_t allocated;         // bytes of chunk memory backing the file
+    // FS_REG loaded from a binary image: the file's bytes in the mapped
+    // image, read wherever no chunk has been written yet. Only the extents
+    // are stored; the rest of the first mapped_len bytes are holes.
+    const char *mapped;               // the image's data region
+    const file_extent *extents;       // sorted by offset
+    size_t num_extents;
+    size_t mapped_len;
+    size_t mapped_stored;     // bytes of it not yet shadowed by chunks
+    // FS_REG loaded from a JSON image and not changed since: the encoded
+    // data string in the image (0 length otherwise), and whether it is
+    // currently decoded into chunks. See file_load.
+    off_t image_offset;
+    size_t image_len;
+    bool image_loaded;
+    bool image_referenced;  // read since the evictor last passed
+    struct fs_object *cache_prev, *cache_next;  // loaded files, under data_cache_mutex
+    fs_dir *dir;    // FS_DIR; read without locks, so never shares storage with data
+    // Bumped after every change to a directory's entries and when the slot
+    // is freed. Lookup cache entries remember the parent's version and are
+    // ignored once it moves on. Never reset, so it survives slot reuse.
+    _Atomic unsigned long version;
+    // Snapshot generation when the object last changed; see snapshot_preserve.
+    unsigned long snap_gen;
+    // Lookups the kernel holds on the inode: one per lookup, create or
+    // mkdir reply, given back by forget. Lookups count under the read lock,
+    // hence atomic. An inode that loses its last link while the kernel still
+    // holds lookups is only marked unlinked; the last forget frees it.
+    _Atomic unsigned long nlookup;
+    bool unlinked;
+} fs_object;
+
+// The inode table is split into segments of INODE_SEGMENT_SIZE objects.
+// The segment directory is sized for max_inodes when the image is loaded;
+// segments are allocated as the inode numbers in them are first handed
+// out and are never moved or freed, so pointers to objects (and the locks
+// inside them) stay valid however large the table grows. Lookups read the
+// directory without locks: a segment is published before any inode in it
+// can be reached.
+#define INODE_SEGMENT_SHIFT 10
+#define INODE_SEGMENT_SIZE (1 << INODE_SEGMENT_SHIFT)
+
+static _Atomic(fs_object *) *inode_segments;
+static int num_inode_segments;
+
+static inline fs_object *fs_obj(int inode) {
+    fs_object *segment = atomic_load_explicit(&inode_segments[inode >> INODE_SEGMENT_SHIFT], memory_order_acquire);
+    return &segment[inode & (INODE_SEGMENT_SIZE - 1)];
 }
 
-static int fuse_example_read(const char *path, char *buf, size_t size, off_t offset,
-                             struct fuse_file_info *fi) {
-    int inode = lookup_inode(path);
-    if (inode < 0) return -ENOENT;  // No such file or directory
+// Make sure the segment holding inode exists. Safe to call from several
+// threads at once: if two race to fill the same slot, the loser's segment
+// is thrown away.
+static int inode_segment_alloc(int inode) {
+    int index = inode >> INODE_SEGMENT_SHIFT;
+    if (atomic_load_explicit(&inode_segments[index], memory_order_acquire)) return 0;
 
-    const fs_object *obj = &fs_objects[inode];
-    if (obj->data) {
-        size_t len = strlen(obj->data);
-        if (offset >= len) {
-            return 0;
-        }
-        if (offset + size > len) {
-            size = len - offset;
+    fs_object *segment = calloc(INODE_SEGMENT_SIZE, sizeof(fs_object));
+    if (!segment) return -ENOMEM;
+    for (int i = 0; i < INODE_SEGMENT_SIZE; i++) {
+        pthread_rwlock_init(&segment[i].lock, NULL);
+    }
+    fs_object *expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&inode_segments[index], &expected, segment,
+                                                 memory_order_acq_rel, memory_order_acquire)) {
+        for (int i = 0; i < INODE_SEGMENT_SIZE; i++) {
+            pthread_rwlock_destroy(&segment[i].lock);
         }
-        memcpy(buf, obj->data + offset, size);
-    } else {
-        size = 0;
+        free(segment);
     }
+    return 0;
+}
 
-    return size;
+static const char *fs_type_name(fs_type type) {
+    switch (type) {
+    case FS_REG: return "reg";
+    case FS_DIR: return "dir";
+    default: return NULL;
+    }
 }
 
-static int fuse_example_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                                off_t offset, struct fuse_file_info *fi) {
-    (void) offset;
-    (void) fi;
+static fs_type fs_type_from_name(const char *name) {
+    if (name && strcmp(name, "reg") == 0) return FS_REG;
+    if (name && strcmp(name, "dir") == 0) return FS_DIR;
+    return FS_FREE;
+}
 
-    int inode = lookup_inode(path);
-    if (inode < 0) return -ENOENT;  // No such file or directory
+static unsigned int name_hash(const char *name) {
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static fs_dir_table *dir_table_new(unsigned int num_buckets) {
+    fs_dir_table *table = calloc(1, sizeof(fs_dir_table) + num_buckets * sizeof(fs_dentry *));
+    if (!table) return NULL;
+    table->num_buckets = num_buckets;
+    return table;
+}
 
-    const fs_object *obj = &fs_objects[inode];
+// A directory whose hash table is already big enough for num_entries
+// entries, so filling it doesn't have to grow the table step by step.
+static fs_dir *dir_new_sized(int num_entries) {
+    unsigned int num_buckets = DIR_MIN_BUCKETS;
+    while (num_buckets < (unsigned int)num_entries) num_buckets *= 2;
 
-    if(strcmp(obj->type, "dir") != 0) {
-        return -ENOTDIR; // Not a directory
+    fs_dir *dir = pool_alloc(sizeof(fs_dir));
+    if (!dir) return NULL;
+    memset(dir, 0, sizeof(fs_dir));
+    fs_dir_table *table = dir_table_new(num_buckets);
+    if (!table) {
+        pool_free(dir);
+        return NULL;
     }
+    atomic_init(&dir->table, table);
+    dir->next_cookie = DIR_FIRST_COOKIE;
+    return dir;
+}
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+static fs_dir *dir_new(void) {
+    return dir_new_sized(0);
+}
 
-    int entries_length = json_object_array_length(obj->entries);
-    for(int i = 0; i < entries_length; i++) {
-        struct json_object *entry_obj = json_object_array_get_idx(obj->entries, i);
-        struct json_object *name_obj;
+// Free a directory and everything in it. Only call this once no reader can
+// reach it, either directly at load time or through epoch_retire.
+static void dir_free(void *ptr) {
+    fs_dir *dir = ptr;
+    if (!dir) return;
+    for (int c = 0; c < dir->num_chunks; c++) {
+        for (int i = 0; i < dir->chunks[c]->count; i++) {
+            pool_free(dir->chunks[c]->entries[i]);
+        }
+        free(dir->chunks[c]);
+    }
+    free(dir->chunks);
+    free(atomic_load_explicit(&dir->table, memory_order_relaxed));
+    pool_free(dir);
+}
 
-        if (json_object_object_get_ex(entry_obj, "name", &name_obj)) {
-            const char *name = json_object_get_string(name_obj);
-            filler(buf, name, NULL, 0);
+// Lock-free: callers either hold the directory lock or are inside an epoch.
+static fs_dentry *dir_find(fs_dir *dir, const char *name) {
+    unsigned int hash = name_hash(name);
+    fs_dir_table *table = atomic_load_explicit(&dir->table, memory_order_acquire);
+    fs_dentry *dentry = atomic_load_explicit(&table->heads[hash & (table->num_buckets - 1)], memory_order_acquire);
+    for (; dentry; dentry = atomic_load_explicit(&dentry->next, memory_order_acquire)) {
+        if (dentry->hash == hash && strcmp(dentry->name, name) == 0) {
+            return dentry;
         }
     }
+    return NULL;
+}
 
-    return 0;
+static int dir_lookup(fs_dir *dir, const char *name) {
+    const fs_dentry *dentry = dir_find(dir, name);
+    return dentry ? dentry->inode : -1;
 }
 
-static int fuse_example_write(const char *path, const char *buf, size_t size, off_t offset,
-                              struct fuse_file_info *fi) {
-	int inode = lookup_inode(path);
-    if (inode < 0) return -ENOENT;
-	size_t  new_size = offset + size;
-	if(new_size > MAX_TEXT_SIZE) return -EFBIG;
-    fs_object *obj = &fs_objects[inode];
-    if (obj->data) {
-        // Make sure the file is large enough to write the data.
-        size_t new_size = offset + size;
-        if (new_size > strlen(obj->data)) {
-            obj->data = realloc(obj->data, new_size + 1);  // +1 for the null terminator
-            if (!obj->data) return -ENOMEM;
-            memset(obj->data + strlen(obj->data), 0, new_size - strlen(obj->data));
-        }
-
-        // Write the data.
-        memcpy(obj->data + offset, buf, size);
-    } else {
-        // No data yet, so allocate a new buffer.
-        obj->data = calloc(1, size + 1);  // +1 for the null terminator
-        if (!obj->data) return -ENOMEM;
-        memcpy(obj->data, buf, size);
+// Old hash nodes left behind by dir_grow_table, retired as one object.
+typedef struct {
+    int count;
+    fs_dentry *nodes[];
+} dentry_batch;
+
+static void dentry_batch_free(void *ptr) {
+    dentry_batch *batch = ptr;
+    for (int i = 0; i < batch->count; i++) {
+        pool_free(batch->nodes[i]);
     }
-    return size;
+    free(batch);
 }
 
-static int fuse_example_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-	pthread_mutex_lock(&fs_mutex);
-	if(num_fs_objects >= MAX_FILES) return -EDQUOT;
-    printf("fuse_example_create called with path: %s\n", path);
-    
-    int parent_inode = lookup_inode(dirname(strdup(path)));
-    if (parent_inode < 0) return -ENOENT;
+// Double the bucket count. Readers may be walking the old chains, so the
+// entries are copied into fresh nodes for the new table rather than
+// relinked; the old table and nodes are retired.
+static void dir_grow_table(fs_dir *dir) {
+    fs_dir_table *old_table = atomic_load_explicit(&dir->table, memory_order_relaxed);
+    fs_dir_table *new_table = dir_table_new(old_table->num_buckets * 2);
+    dentry_batch *old_nodes = malloc(sizeof(dentry_batch) + dir->num_entries * sizeof(fs_dentry *));
+    if (!new_table || !old_nodes) goto fail;  // keep the old table, chains just get longer
 
-    if (lookup_inode(path) >= 0) return -EEXIST;
+    old_nodes->count = 0;
+    int n = 0;
+    for (int c = 0; c < dir->num_chunks; c++) {
+        for (int i = 0; i < dir->chunks[c]->count; i++, n++) {
+            // The copies, for now.
+            old_nodes->nodes[n] = pool_alloc(sizeof(fs_dentry) + strlen(dir->chunks[c]->entries[i]->name) + 1);
+            if (!old_nodes->nodes[n]) {
+                while (n-- > 0) pool_free(old_nodes->nodes[n]);
+                goto fail;
+            }
+        }
+    }
 
-    // Allocate a new fs_object.
-    num_fs_objects++;
-    fs_objects = realloc(fs_objects, num_fs_objects * sizeof(fs_object));
-    if (!fs_objects) return -ENOMEM;
-
-    // Initialize the new fs_object.
-    fs_object *new_obj = &fs_objects[num_fs_objects - 1];
-    memset(new_obj, 0, sizeof(fs_object));
-    new_obj->inode = num_fs_objects - 1;  // Assume that inodes are allocated sequentially.
-    new_obj->type = "reg";
-	char *temp_path = strdup(path);
-    new_obj->name = strdup(basename(temp_path));  // The name is only the last part of the path.
-	free (temp_path);
-    if (!new_obj->name) return -ENOMEM;
-    new_obj->data = NULL;  // Initially, the file has no data.
-    new_obj->entries = NULL;  // Since it's not a directory, entries is NULL.
-
-    // Add the new file to its parent directory.
-    fs_object *parent_obj = &fs_objects[parent_inode];
-    struct json_object *entry_obj = json_object_new_object();
-    json_object_object_add(entry_obj, "name", json_object_new_string(new_obj->name));
-    json_object_object_add(entry_obj, "inode", json_object_new_int(new_obj->inode));
-    json_object_array_add(parent_obj->entries, entry_obj);
-
-    // Open the new file.
-    fi->fh = new_obj->inode;
-
-    printf("fuse_example_create returning: %d\n", 0);
-    pthread_mutex_unlock(&fs_mutex);
-	return 0;
-}
+    n = 0;
+    for (int c = 0; c < dir->num_chunks; c++) {
+        for (int i = 0; i < dir->chunks[c]->count; i++, n++) {
+            fs_dentry *old = dir->chunks[c]->entries[i];
+            fs_dentry *dentry = old_nodes->nodes[n];
+            dentry->hash = old->hash;
+            dentry->inode = old->inode;
+            dentry->cookie = old->cookie;
+            strcpy(dentry->name, old->name);
+            unsigned int b = dentry->hash & (new_table->num_buckets - 1);
+            atomic_init(&dentry->next, atomic_load_explicit(&new_table->heads[b], memory_order_relaxed));
+            atomic_init(&new_table->heads[b], dentry);
+            dir->chunks[c]->entries[i] = dentry;
+            old_nodes->nodes[n] = old;
+        }
+    }
+    old_nodes->count = n;
+    atomic_store_explicit(&dir->table, new_table, memory_order_release);
 
-static int fuse_example_getattr(const char *path, struct stat *stbuf) {
-    int res = 0;
+    epoch_retire(old_table, free);
+    epoch_retire(old_nodes, dentry_batch_free);
+    return;
 
-    memset(stbuf, 0, sizeof(struct stat));
-    if(strcmp(path, "/") == 0) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-    } else {
-        int inode = lookup_inode(path);
-        if (inode < 0) return -ENOENT;
-
-        fs_object *obj = &fs_objects[inode];
-        if (strcmp(obj->type, "reg") == 0) {
-            stbuf->st_mode = S_IFREG | 0666;
-            stbuf->st_nlink = 1;
-            stbuf->st_size = obj->data ? strlen(obj->data) : 0;
-        } else if (strcmp(obj->type, "dir") == 0) {
-            stbuf->st_mode = S_IFDIR | 0755;
-            stbuf->st_nlink = 2;
+fail:
+    free(new_table);
+    free(old_nodes);
+}
+
+// Index of the first chunk that holds an entry with a cookie of at least
+// `cookie`, or num_chunks if there is none.
+static int dir_chunk_find(const fs_dir *dir, off_t cookie) {
+    int lo = 0, hi = dir->num_chunks;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        const fs_dir_chunk *chunk = dir->chunks[mid];
+        if (chunk->entries[chunk->count - 1]->cookie < cookie) {
+            lo = mid + 1;
         } else {
-            res = -ENOENT;
+            hi = mid;
         }
     }
-    return res;
+    return lo;
 }
 
-static int fuse_example_truncate(const char *path, off_t newsize) {
-    int inode = lookup_inode(path);
-    if (inode < 0) return -ENOENT;  // No such file or directory
+// Position of the first entry in chunk with a cookie of at least `cookie`.
+static int dir_chunk_pos(const fs_dir_chunk *chunk, off_t cookie) {
+    int lo = 0, hi = chunk->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (chunk->entries[mid]->cookie < cookie) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
 
-    fs_object *obj = &fs_objects[inode];
-    if (obj->data) {
-        // Resize the data.
-        obj->data = realloc(obj->data, newsize + 1);  // +1 for the null terminator
-        if (!obj->data) return -ENOMEM;
-        if (newsize > strlen(obj->data)) {
-            memset(obj->data + strlen(obj->data), 0, newsize - strlen(obj->data));
+// Append dentry, which has the highest cookie so far, to the listing.
+static int dir_listing_append(fs_dir *dir, fs_dentry *dentry) {
+    fs_dir_chunk *last = dir->num_chunks ? dir->chunks[dir->num_chunks - 1] : NULL;
+    if (!last || last->count == DIR_CHUNK_ENTRIES) {
+        if (dir->num_chunks == dir->max_chunks) {
+            int new_max = dir->max_chunks ? dir->max_chunks * 2 : 1;
+            fs_dir_chunk **new_chunks = realloc(dir->chunks, new_max * sizeof(fs_dir_chunk *));
+            if (!new_chunks) return -ENOMEM;
+            dir->chunks = new_chunks;
+            dir->max_chunks = new_max;
         }
-        obj->data[newsize] = '\0';
+        last = malloc(sizeof(fs_dir_chunk));
+        if (!last) return -ENOMEM;
+        last->count = 0;
+        dir->chunks[dir->num_chunks++] = last;
+    }
+    last->entries[last->count++] = dentry;
+    return 0;
+}
+
+// Fold chunk c + 1 into chunk c when together they are at most half full,
+// so a directory that shrinks doesn't keep a long tail of sparse chunks.
+static void dir_chunk_merge(fs_dir *dir, int c) {
+    if (c < 0 || c + 1 >= dir->num_chunks) return;
+    fs_dir_chunk *chunk = dir->chunks[c], *next = dir->chunks[c + 1];
+    if (chunk->count + next->count > DIR_CHUNK_ENTRIES / 2) return;
+
+    memcpy(chunk->entries + chunk->count, next->entries, next->count * sizeof(fs_dentry *));
+    chunk->count += next->count;
+    free(next);
+    memmove(dir->chunks + c + 1, dir->chunks + c + 2, (dir->num_chunks - c - 2) * sizeof(fs_dir_chunk *));
+    dir->num_chunks--;
+}
+
+static void dir_listing_remove(fs_dir *dir, const fs_dentry *dentry) {
+    int c = dir_chunk_find(dir, dentry->cookie);
+    fs_dir_chunk *chunk = dir->chunks[c];
+    int i = dir_chunk_pos(chunk, dentry->cookie);
+    memmove(chunk->entries + i, chunk->entries + i + 1, (chunk->count - i - 1) * sizeof(fs_dentry *));
+    if (--chunk->count == 0) {
+        free(chunk);
+        memmove(dir->chunks + c, dir->chunks + c + 1, (dir->num_chunks - c - 1) * sizeof(fs_dir_chunk *));
+        dir->num_chunks--;
+        dir_chunk_merge(dir, c - 1);
     } else {
-        // No data yet, so allocate a new buffer.
-        obj->data = calloc(1, newsize + 1);  // +1 for the null terminator
-        if (!obj->data) return -ENOMEM;
+        dir_chunk_merge(dir, c);
+        dir_chunk_merge(dir, c - 1);
     }
+}
 
-    return 0;
+static void dir_changed(fs_object *dir_obj) {
+    atomic_fetch_add_explicit(&dir_obj->version, 1, memory_order_release);
 }
 
-static int fuse_example_utimens(const char *path, const struct timespec tv[2]) {
-    int inode = lookup_inode(path);
-    if (inode < 0) return -ENOENT;  // No such file or directory
+// Fails with -ENOSPC once the directory holds max_dir_entries entries.
+// The caller holds the directory's write lock.
+static int dir_add(fs_object *dir_obj, const char *name, int inode) {
+    fs_dir *dir = dir_obj->dir;
+    if (dir->num_entries >= max_dir_entries) return -ENOSPC;
+
+    size_t name_len = strlen(name);
+    fs_dentry *dentry = pool_alloc(sizeof(fs_dentry) + name_len + 1);
+    if (!dentry) return -ENOMEM;
+    memcpy(dentry->name, name, name_len + 1);
+    dentry->hash = name_hash(name);
+    dentry->inode = inode;
+    dentry->cookie = dir->next_cookie;
+    if (dir_listing_append(dir, dentry) != 0) {
+        pool_free(dentry);
+        return -ENOMEM;
+    }
+    dir->next_cookie++;
+    dir->num_entries++;
 
-    // In a real filesystem, we would update the timestamps in the inode here.
-    // However, since we're not keeping track of timestamps in this example, we'll just do nothing.
+    fs_dir_table *table = atomic_load_explicit(&dir->table, memory_order_relaxed);
+    _Atomic(fs_dentry *) *head = &table->heads[dentry->hash & (table->num_buckets - 1)];
+    atomic_init(&dentry->next, atomic_load_explicit(head, memory_order_relaxed));
+    atomic_store_explicit(head, dentry, memory_order_release);
 
+    if ((unsigned int)dir->num_entries > table->num_buckets) {
+        dir_grow_table(dir);
+    }
+    dir_changed(dir_obj);
     return 0;
 }
 
-static int fuse_example_mkdir(const char *path, mode_t mode) {
+// Remove name from the directory. Returns the inode it pointed to, or -1.
+// The caller holds the directory's write lock.
+static int dir_remove(fs_object *dir_obj, const char *name) {
+    fs_dir *dir = dir_obj->dir;
+    unsigned int hash = name_hash(name);
+    fs_dir_table *table = atomic_load_explicit(&dir->table, memory_order_relaxed);
+    _Atomic(fs_dentry *) *link = &table->heads[hash & (table->num_buckets - 1)];
+    fs_dentry *dentry;
+    while ((dentry = atomic_load_explicit(link, memory_order_relaxed))) {
+        if (dentry->hash == hash && strcmp(dentry->name, name) == 0) {
+            // Readers standing on dentry can still follow its next pointer.
+            atomic_store_explicit(link, atomic_load_explicit(&dentry->next, memory_order_relaxed), memory_order_release);
 
-    printf("fuse_example_mkdir called with path: %s\n", path);
-    
-    if (lookup_inode(path) >= 0){
-		return -EEXIST; // Directory already exists
-	}
-	
-    // Allocate a new fs_object.
-    num_fs_objects++;
-    fs_objects = realloc(fs_objects, num_fs_objects * sizeof(fs_object));
-    if (!fs_objects){ 
-		 return -ENOMEM; // Not enough memory
-		}
-
-    // Initialize the new fs_object.
-    fs_object *new_obj = &fs_objects[num_fs_objects - 1];
-    memset(new_obj, 0, sizeof(fs_object));
-    new_obj->inode = num_fs_objects - 1;  // Assume that inodes are allocated sequentially.
-    new_obj->type = "dir";
-    new_obj->name = strdup(path + 1);  // Skip the leading slash
-    if (!new_obj->name) return -ENOMEM; // Not enough memory
-    new_obj->data = NULL;  // Since it's a directory, there's no data.
-    new_obj->entries = json_object_new_array();  // Create an empty array of entries.
-
-    // Find the parent directory.
-    char *parent_path = strdup(path);
-    dirname(parent_path);
-    int parent_inode = lookup_inode(parent_path);
-    free(parent_path);
-    if (parent_inode < 0) return -ENOENT;  // Parent directory does not exist.
-    fs_object *parent_obj = &fs_objects[parent_inode];
-
-    // Add the new directory to the parent directory.
-    struct json_object *entry_obj = json_object_new_object();
-    json_object_object_add(entry_obj, "name", json_object_new_string(new_obj->name));
-    json_object_object_add(entry_obj, "inode", json_object_new_int(new_obj->inode));
-    json_object_array_add(parent_obj->entries, entry_obj);
-
-    printf("fuse_example_mkdir returning: %d\n", 0);
-    return 0;
+            dir_listing_remove(dir, dentry);
+            dir->num_entries--;
+
+            int inode = dentry->inode;
+            dir_changed(dir_obj);
+            epoch_retire(dentry, pool_free);
+            return inode;
+        }
+        link = &dentry->next;
+    }
+    return -1;
+}
+
+static void file_free_data(fs_object *obj);
+static void file_detach_image(fs_object *obj);
+
+static void free_fs_object(fs_object *obj) {
+    free(obj->name);
+    file_detach_image(obj);
+    file_free_data(obj);
+    if (obj->dir) {
+        // Lock-free lookups may still be walking it.
+        epoch_retire(obj->dir, dir_free);
+    }
+    obj->type = FS_FREE;
+    __atomic_store_n(&obj->dir, NULL, __ATOMIC_RELEASE);
+    atomic_fetch_add_explicit(&obj->version, 1, memory_order_release);
+    obj->nlink = 0;
+    obj->unlinked = false;
+    obj->size = 0;
+    obj->name = NULL;
+}
+
+// File data lives in fixed-size chunks, so a file can grow to any size
+// without one huge allocation, and a write in the middle only touches the
+// chunks it covers. Files are sparse: a NULL chunk is a hole that reads as
+// zeros, and extending a file with truncate or a write past the end only
+// moves size. Chunk 0 may be allocated smaller than CHUNK_SIZE and grows
+// geometrically as it is written, so small files don't pay for a whole
+// chunk; bytes past its allocation read as zeros too. Allocated bytes past
+// the end of the file are kept zeroed. Files that have never been written
+// past INLINE_DATA_SIZE skip all of this and keep their bytes in the
+// record itself (see file_spill). Files loaded from a binary image start
+// out with no chunks at all, reading straight from the mapped image; a
+// chunk is copied out of the mapping the first time it is written. Large
+// files from a JSON image also start with no chunks, and are decoded into
+// them on first access (file_load). Every
+// function here expects the caller to hold the object's lock (write lock
+// for anything that changes the file).
+//
+// Chunks are reference counted so that snapshots can share them with the
+// live file (see snapshot_freeze). A shared chunk is copied before it is
+// written, and freed with its last reference.
+#define CHUNK_SHIFT 12
+#define CHUNK_SIZE ((size_t)1 << CHUNK_SHIFT)
+#define FIRST_CHUNK_MIN_SIZE 64
+
+// In front of every chunk's bytes; max_align_t keeps the bytes aligned.
+typedef union {
+    atomic_int refs;
+    max_align_t align;
+} chunk_header;
+
+static chunk_header *chunk_header_of(const char *chunk) {
+    return (chunk_header *)chunk - 1;
+}
+
+// A new chunk of size bytes, zeroed if zero is set, with one reference.
+static char *chunk_alloc(size_t size, bool zero) {
+    chunk_header *h = zero ? calloc(1, sizeof(chunk_header) + size) : malloc(sizeof(chunk_header) + size);
+    if (!h) return NULL;
+    atomic_init(&h->refs, 1);
+    return (char *)(h + 1);
+}
+
+// Resize an unshared chunk (or allocate one, if chunk is NULL).
+static char *chunk_realloc(char *chunk, size_t size) {
+    chunk_header *h = realloc(chunk ? chunk_header_of(chunk) : NULL, sizeof(chunk_header) + size);
+    if (!h) return NULL;
+    if (!chunk) atomic_init(&h->refs, 1);
+    return (char *)(h + 1);
+}
+
+static void chunk_get(char *chunk) {
+    atomic_fetch_add_explicit(&chunk_header_of(chunk)->refs, 1, memory_order_relaxed);
+}
+
+static void chunk_put(char *chunk) {
+    if (chunk && atomic_fetch_sub_explicit(&chunk_header_of(chunk)->refs, 1, memory_order_acq_rel) == 1) {
+        free(chunk_header_of(chunk));
+    }
+}
+
+static bool chunk_shared(const char *chunk) {
+    return atomic_load_explicit(&chunk_header_of(chunk)->refs, memory_order_acquire) > 1;
 }
 
+static size_t chunk_count(size_t size) {
+    return (size + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+}
+
+// Bytes allocated for chunk index, 0 for a hole.
+static size_t chunk_alloc_size(const fs_object *obj, size_t index) {
+    if (index >= obj->max_chunks || !obj->chunks[index]) return 0;
+    return index == 0 ? obj->first_chunk_size : CHUNK_SIZE;
+}
+
+static void file_free_chunk(fs_object *obj, size_t index) {
+    obj->allocated -= chunk_alloc_size(obj, index);
+    chunk_put(obj->chunks[index]);
+    obj->chunks[index] = NULL;
+    if (index == 0) obj->first_chunk_size = 0;
+}
+
+// Start obj out as an empty file with inline storage.
+static void file_init_data(fs_object *obj) {
+    obj->data_inline = true;
+    memset(obj->inline_data, 0, INLINE_DATA_SIZE);
+    obj->allocated = 0;
+    obj->mapped = NULL;
+    obj->extents = NULL;
+    obj->num_extents = 0;
+    obj->mapped_len = 0;
+    obj->mapped_stored = 0;
+    obj->image_len = 0;
+    obj->image_loaded = false;
+}
+
+// Start obj out as a file of size bytes whose extents are in a mapped
+// image's data region at data.
+static void file_init_mapped(fs_object *obj, const char *data, const file_extent *extents,
+                             size_t num_extents, size_t size) {
+    obj->data_inline = false;
+    obj->chunks = NULL;
+    obj->max_chunks = 0;
+    obj->first_chunk_size = 0;
+    obj->allocated = 0;
+    obj->mapped = data;
+    obj->extents = extents;
+    obj->num_extents = num_extents;
+    obj->mapped_len = size;
+    obj->mapped_stored = 0;
+    for (size_t i = 0; i < num_extents; i++) {
+        obj->mapped_stored += extents[i].len;
+    }
+    obj->size = size;
+    obj->image_len = 0;
+    obj->image_loaded = false;
+}
+
+// Start obj out as a file of size bytes whose data is the JSON string at
+// offset in the image, not loaded yet.
+static void file_init_lazy(fs_object *obj, off_t offset, size_t len, size_t size) {
+    file_init_mapped(obj, NULL, NULL, 0, 0);
+    obj->size = size;
+    obj->image_offset = offset;
+    obj->image_len = len;
+}
+
+// True while the file's data is only in the image.
+static bool file_unloaded(const fs_object *obj) {
+    return obj->image_len && !obj->image_loaded;
+}
+
+// Leaves obj with no data and an empty chunk table.
+static void file_free_data(fs_object *obj) {
+    obj->mapped = NULL;
+    obj->extents = NULL;
+    obj->num_extents = 0;
+    obj->mapped_len = 0;
+    obj->mapped_stored = 0;
+    if (obj->data_inline) {
+        obj->data_inline = false;
+        obj->chunks = NULL;
+        obj->max_chunks = 0;
+        obj->first_chunk_size = 0;
+        return;
+    }
+    for (size_t i = 0; i < obj->max_chunks; i++) {
+        chunk_put(obj->chunks[i]);
+    }
+    free(obj->chunks);
+    obj->chunks = NULL;
+    obj->max_chunks = 0;
+    obj->first_chunk_size = 0;
+    obj->allocated = 0;
+}
 
+// Make room in the chunk table for num_chunks chunks, growing it
+// geometrically. New slots are holes.
+static int file_reserve_chunks(fs_object *obj, size_t num_chunks) {
+    if (num_chunks <= obj->max_chunks) return 0;
 
-static int fuse_example_unlink(const char *path) {
-    printf("fuse_example_unlink called with path: %s\n", path);
+    size_t new_max = obj->max_chunks ? obj->max_chunks : 1;
+    while (new_max < num_chunks) {
+        new_max *= 2;
+    }
+    char **new_chunks = realloc(obj->chunks, new_max * sizeof(char *));
+    if (!new_chunks) return -ENOMEM;
+    memset(new_chunks + obj->max_chunks, 0, (new_max - obj->max_chunks) * sizeof(char *));
+    obj->chunks = new_chunks;
+    obj->max_chunks = new_max;
+    return 0;
+}
 
-    int inode = lookup_inode(path);
-    if (inode < 0) return -ENOENT;
+// Give the file its own copy of chunk index if a snapshot shares it.
+static int file_unshare_chunk(fs_object *obj, size_t index) {
+    char *chunk = obj->chunks[index];
+    if (!chunk || !chunk_shared(chunk)) return 0;
+    size_t size = chunk_alloc_size(obj, index);
+    char *copy = chunk_alloc(size, false);
+    if (!copy) return -ENOMEM;
+    memcpy(copy, chunk, size);
+    chunk_put(chunk);
+    obj->chunks[index] = copy;
+    return 0;
+}
 
-    // If the fs_object is a directory and not empty, return -ENOTEMPTY
-    if(strcmp(fs_objects[inode].type, "dir") == 0) {
-        struct json_object *entry_list = fs_objects[inode].entries;
-        int num_entries = json_object_array_length(entry_list);
-        if(num_entries > 0) {
-            return -ENOTEMPTY;
+// Index of the first extent that ends past pos, or num_extents.
+static size_t file_extent_after(const fs_object *obj, size_t pos) {
+    size_t lo = 0, hi = obj->num_extents;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (obj->extents[mid].offset + obj->extents[mid].len <= pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
+    return lo;
+}
 
-    // Free the memory for the file's name and data.
-    free(fs_objects[inode].name);
-    if (fs_objects[inode].data) free(fs_objects[inode].data);
+// The mapped image's bytes at pos, or NULL if pos is in a hole of the
+// mapping or past mapped_len. *len is set to how many follow contiguously.
+static const char *file_mapped_at(const fs_object *obj, size_t pos, size_t *len) {
+    if (pos >= obj->mapped_len) return NULL;
+    size_t i = file_extent_after(obj, pos);
+    if (i == obj->num_extents || obj->extents[i].offset > pos) return NULL;
+    const file_extent *e = &obj->extents[i];
+    size_t end = e->offset + e->len < obj->mapped_len ? e->offset + e->len : obj->mapped_len;
+    *len = end - pos;
+    return obj->mapped + e->start + (pos - e->offset);
+}
 
-    // Add the inode back to the free list
-    add_free_inode(inode);
+// Make sure chunk index has backing memory for its first `end` bytes and
+// can be written. New memory is zero-filled, or copied from the mapped
+// image where it covers the chunk.
+static int file_prepare_chunk(fs_object *obj, size_t index, size_t end) {
+    int res = file_unshare_chunk(obj, index);
+    if (res != 0) return res;
 
-    // Reset fs_object fields
-    fs_objects[inode].type = NULL;
-    fs_objects[inode].name = NULL;
-    fs_objects[inode].data = NULL;
-    fs_objects[inode].entries = NULL;
+    size_t n;
+    const char *mapped = obj->chunks[index] ? NULL : file_mapped_at(obj, index << CHUNK_SHIFT, &n);
+    if (mapped) {
+        // Always a whole chunk, so no part of it is left reading the mapping.
+        char *chunk = chunk_alloc(CHUNK_SIZE, false);
+        if (!chunk) return -ENOMEM;
+        if (n > CHUNK_SIZE) n = CHUNK_SIZE;
+        memcpy(chunk, mapped, n);
+        memset(chunk + n, 0, CHUNK_SIZE - n);
+        obj->chunks[index] = chunk;
+        obj->allocated += CHUNK_SIZE;
+        obj->mapped_stored -= n;
+        if (index == 0) obj->first_chunk_size = CHUNK_SIZE;
+        return 0;
+    }
 
-    // Remove the entry for this file from its parent directory.
-    char *parent_path = strdup(path);
-    dirname(parent_path);
-    int parent_inode = lookup_inode(parent_path);
-    free(parent_path);
-    if (parent_inode < 0) return -ENOENT;  // This should never happen.
+    if (index == 0) {
+        if (end <= obj->first_chunk_size) return 0;
 
-    struct json_object *entry_list = fs_objects[parent_inode].entries;
-    int num_entries = json_object_array_length(entry_list);
-    for (int i = 0; i < num_entries; i++) {
-        struct json_object *entry_obj = json_object_array_get_idx(entry_list, i);
-        struct json_object *inode_obj;
-        if (json_object_object_get_ex(entry_obj, "inode", &inode_obj)) {
-            int entry_inode = json_object_get_int(inode_obj);
-            if (entry_inode == inode) {
-                // We've found the entry for the file we're deleting. Remove it.
-                // Since there's no json_object_array_remove_idx, we have to create a new array without the deleted element.
-                struct json_object *new_entry_list = json_object_new_array();
-                for (int j = 0; j < num_entries; j++) {
-                    if (j != i) {
-                        json_object_array_add(new_entry_list, json_object_array_get_idx(entry_list, j));
-                    }
-                }
-                json_object_put(entry_list);  // Decrement the reference count of the old entry_list so it gets freed.
-                fs_objects[parent_inode].entries = new_entry_list;  // Use the new entry_list.
-                break;
-            }
+        size_t new_first = obj->first_chunk_size ? obj->first_chunk_size : FIRST_CHUNK_MIN_SIZE;
+        while (new_first < end) {
+            new_first *= 2;
         }
+        if (new_first > CHUNK_SIZE) new_first = CHUNK_SIZE;
+        char *chunk = chunk_realloc(obj->chunks[0], new_first);
+        if (!chunk) return -ENOMEM;
+        memset(chunk + obj->first_chunk_size, 0, new_first - obj->first_chunk_size);
+        obj->allocated += new_first - obj->first_chunk_size;
+        obj->chunks[0] = chunk;
+        obj->first_chunk_size = new_first;
+        return 0;
     }
 
-    printf("fuse_example_unlink returning: %d\n", 0);
+    if (!obj->chunks[index]) {
+        obj->chunks[index] = chunk_alloc(CHUNK_SIZE, true);
+        if (!obj->chunks[index]) return -ENOMEM;
+        obj->allocated += CHUNK_SIZE;
+    }
     return 0;
 }
 
-// Declare the json_object_array_splice() function.
-extern void json_object_array_splice(struct json_object *array, int index, int num_elements);
+// Bytes of the mapped image in [start, end) that are still read, because
+// no chunk has been written over them.
+static size_t file_mapped_unshadowed(const fs_object *obj, size_t start, size_t end) {
+    if (end > obj->mapped_len) end = obj->mapped_len;
+    size_t n = 0;
+    for (size_t i = file_extent_after(obj, start); i < obj->num_extents; i++) {
+        const file_extent *e = &obj->extents[i];
+        size_t pos = e->offset > start ? e->offset : start;
+        size_t stop = e->offset + e->len < end ? e->offset + e->len : end;
+        if (pos >= end) break;
+        while (pos < stop) {
+            size_t index = pos >> CHUNK_SHIFT;
+            size_t next = (index + 1) << CHUNK_SHIFT;
+            if (next > stop) next = stop;
+            if (!chunk_alloc_size(obj, index)) n += next - pos;
+            pos = next;
+        }
+    }
+    return n;
+}
 
+// Move inline data into chunk 0 of a fresh chunk table, ahead of a write
+// that doesn't fit in the record.
+static int file_spill(fs_object *obj) {
+    char data[INLINE_DATA_SIZE];
+    memcpy(data, obj->inline_data, INLINE_DATA_SIZE);
 
+    obj->data_inline = false;
+    obj->chunks = NULL;
+    obj->max_chunks = 0;
+    obj->first_chunk_size = 0;
+    int res = file_reserve_chunks(obj, 1);
+    if (res == 0) res = file_prepare_chunk(obj, 0, INLINE_DATA_SIZE);
+    if (res != 0) {
+        file_free_data(obj);
+        memcpy(obj->inline_data, data, INLINE_DATA_SIZE);
+        obj->data_inline = true;
+        return res;
+    }
+    memcpy(obj->chunks[0], data, INLINE_DATA_SIZE);
+    return 0;
+}
 
-static int fuse_example_rmdir(const char *path)
-{
-    printf("fuse_example_rmdir called with path: %s\n", path);
+// Set the file length. Growing only records the new size, leaving a hole.
+// Shrinking frees the chunks past the end and zeroes the rest of the last
+// one, so a later extension reads zeros.
+static int file_resize(fs_object *obj, size_t size) {
+    if (obj->data_inline) {
+        if (size < INLINE_DATA_SIZE) memset(obj->inline_data + size, 0, INLINE_DATA_SIZE - size);
+    } else if (size < obj->size) {
+        size_t new_chunks = chunk_count(size);
+        size_t tail = size & (CHUNK_SIZE - 1);
+        size_t last = new_chunks - 1;
+        // Before anything is freed, so a failure leaves the file as it was.
+        if (tail && chunk_alloc_size(obj, last) > tail) {
+            int res = file_unshare_chunk(obj, last);
+            if (res != 0) return res;
+        }
 
-    int inode = lookup_inode(path);
-    if (inode < 0) return -ENOENT;
+        if (obj->mapped_len > size) {
+            obj->mapped_stored -= file_mapped_unshadowed(obj, size, obj->mapped_len);
+            obj->mapped_len = size;
+        }
+        for (size_t i = new_chunks; i < chunk_count(obj->size) && i < obj->max_chunks; i++) {
+            if (obj->chunks[i]) file_free_chunk(obj, i);
+        }
+        if (tail) {
+            size_t alloc = chunk_alloc_size(obj, last);
+            if (alloc > tail) memset(obj->chunks[last] + tail, 0, alloc - tail);
+        }
+    }
+    obj->size = size;
+    return 0;
+}
 
-    // If the fs_object is not a directory, return -ENOTDIR
-    if(strcmp(fs_objects[inode].type, "dir") != 0) {
-        return -ENOTDIR;
+static size_t file_read(const fs_object *obj, char *buf, size_t size, off_t offset) {
+    if ((size_t)offset >= obj->size) return 0;
+    if (offset + size > obj->size) {
+        size = obj->size - offset;
     }
 
-    // If the directory is not empty, return -ENOTEMPTY
-    struct json_object *entry_list = fs_objects[inode].entries;
-    int num_entries = json_object_array_length(entry_list);
-    if(num_entries > 0) {
-        return -ENOTEMPTY;
+    if (obj->data_inline) {
+        size_t backed = (size_t)offset < INLINE_DATA_SIZE ? INLINE_DATA_SIZE - offset : 0;
+        if (backed > size) backed = size;
+        if (backed) memcpy(buf, obj->inline_data + offset, backed);
+        if (backed < size) memset(buf + backed, 0, size - backed);
+        return size;
     }
 
-    // Free the memory for the directory's name.
-    free(fs_objects[inode].name);
+    size_t done = 0;
+    while (done < size) {
+        size_t pos = offset + done;
+        size_t index = pos >> CHUNK_SHIFT;
+        size_t in_chunk = pos & (CHUNK_SIZE - 1);
+        size_t n = CHUNK_SIZE - in_chunk;
+        if (n > size - done) n = size - done;
+
+        // Copy what is backed by memory or the mapped image and synthesize
+        // zeros for the rest.
+        const char *src = NULL;
+        size_t backed = 0;
+        size_t alloc = chunk_alloc_size(obj, index);
+        if (alloc) {
+            src = obj->chunks[index] + in_chunk;
+            backed = alloc > in_chunk ? alloc - in_chunk : 0;
+        } else {
+            src = file_mapped_at(obj, pos, &backed);
+        }
+        if (backed > n) backed = n;
+        if (backed) memcpy(buf + done, src, backed);
+        if (backed < n) memset(buf + done + backed, 0, n - backed);
+        done += n;
+    }
+    return size;
+}
 
-    // Mark this fs_object as free.
-    fs_objects[inode].type = NULL;
+// Holes and bytes past a chunk's allocation are read from here.
+static const char zero_chunk[CHUNK_SIZE];
 
-    // Remove the entry for this directory from its parent directory.
-    char *parent_path = strdup(path);
-    dirname(parent_path);
-    int parent_inode = lookup_inode(parent_path);
-    free(parent_path);
-    if (parent_inode < 0) return -ENOENT;  // This should never happen.
+// Entries file_read_iov may need for a read of size bytes: two per chunk
+// touched (data, then zeros past the allocation), plus the ends.
+static size_t file_read_iov_max(size_t size) {
+    return 2 * (size >> CHUNK_SHIFT) + 4;
+}
 
-    struct json_object *parent_entry_list = fs_objects[parent_inode].entries;
-    int parent_num_entries = json_object_array_length(parent_entry_list);
-    for (int i = 0; i < parent_num_entries; i++) {
-        struct json_object *entry_obj = json_object_array_get_idx(parent_entry_list, i);
-        struct json_object *inode_obj;
-        if (json_object_object_get_ex(entry_obj, "inode", &inode_obj)) {
-            int entry_inode = json_object_get_int(inode_obj);
-            if (entry_inode == inode) {
-                // We've found the entry for the directory we're deleting. Remove it.
-                // Since there's no json_object_array_remove_idx, we have to create a new array without the deleted element.
-                struct json_object *new_entry_list = json_object_new_array();
-                for (int j = 0; j < parent_num_entries; j++) {
-                    if (j != i) {
-                        json_object_array_add(new_entry_list, json_object_array_get_idx(parent_entry_list, j));
-                    }
-                }
-                json_object_put(parent_entry_list);  // Decrement the reference count of the old entry_list so it gets freed.
-                fs_objects[parent_inode].entries = new_entry_list;  // Use the new entry_list.
-                break;
-            }
-        }
+static void iov_add(struct iovec *iov, int *n, const char *base, size_t len) {
+    // Runs of the mapped image are contiguous across chunks.
+    if (*n > 0 && (const char *)iov[*n - 1].iov_base + iov[*n - 1].iov_len == base) {
+        iov[*n - 1].iov_len += len;
+    } else {
+        iov[(*n)++] = (struct iovec){ .iov_base = (void *)base, .iov_len = len };
     }
+}
 
-    printf("fuse_example_rmdir returning: %d\n", 0);
-    return 0;
+static void iov_add_zeros(struct iovec *iov, int *n, size_t len) {
+    while (len > 0) {
+        size_t piece = len < CHUNK_SIZE ? len : CHUNK_SIZE;
+        iov_add(iov, n, zero_chunk, piece);
+        len -= piece;
+    }
 }
 
+// Like file_read, but point iov at the bytes where they are instead of
+// copying them: the inline data, chunks, the mapped image, or zero_chunk.
+// iov needs room for file_read_iov_max(size) entries, and the pieces stay
+// valid while the caller holds the object's lock. Returns the number of
+// entries used.
+static int file_read_iov(const fs_object *obj, struct iovec *iov, size_t size, off_t offset) {
+    int n = 0;
+    if ((size_t)offset >= obj->size) return 0;
+    if (offset + size > obj->size) {
+        size = obj->size - offset;
+    }
 
-static struct fuse_operations fuse_example_oper = {
-    .init = fuse_example_init,
-    .destroy = fuse_example_destroy,
-    .getattr = fuse_example_getattr,
-    .open = fuse_example_open,
-    .read = fuse_example_read,
-    .readdir = fuse_example_readdir,
-	.truncate = fuse_example_truncate,
-	.write = fuse_example_write,
-	.create = fuse_example_create,
-    .utimens = fuse_example_utimens,
-    .mkdir = fuse_example_mkdir,
-    .unlink = fuse_example_unlink,
-	.rmdir = fuse_example_rmdir,
-};
+    if (obj->data_inline) {
+        size_t backed = (size_t)offset < INLINE_DATA_SIZE ? INLINE_DATA_SIZE - offset : 0;
+        if (backed > size) backed = size;
+        if (backed) iov_add(iov, &n, obj->inline_data + offset, backed);
+        iov_add_zeros(iov, &n, size - backed);
+        return n;
+    }
 
+    size_t done = 0;
+    while (done < size) {
+        size_t pos = offset + done;
+        size_t index = pos >> CHUNK_SHIFT;
+        size_t in_chunk = pos & (CHUNK_SIZE - 1);
+        size_t len = CHUNK_SIZE - in_chunk;
+        if (len > size - done) len = size - done;
 
+        // Same split as in file_read.
+        const char *src = NULL;
+        size_t backed = 0;
+        size_t alloc = chunk_alloc_size(obj, index);
+        if (alloc) {
+            src = obj->chunks[index] + in_chunk;
+            backed = alloc > in_chunk ? alloc - in_chunk : 0;
+        } else {
+            src = file_mapped_at(obj, pos, &backed);
+        }
+        if (backed > len) backed = len;
+        if (backed) iov_add(iov, &n, src, backed);
+        iov_add_zeros(iov, &n, len - backed);
+        done += len;
+    }
+    return n;
+}
 
-int main(int argc, char *argv[]) {
-	pthread_mutex_init(&fs_mutex,NULL);
-    load_json_fs("fs.json");
-    return fuse_main(argc, argv, &fuse_example_oper, NULL);
+// True if chunk index has memory or mapped bytes behind it.
+static bool file_chunk_stored(const fs_object *obj, size_t index) {
+    size_t len;
+    return chunk_alloc_size(obj, index) || file_mapped_at(obj, index << CHUNK_SHIFT, &len);
 }
 
+// Find the first stored byte at or after pos: returns its offset and sets
+// *len to the length of the run of stored bytes from there, or returns
+// obj->size if only holes are left. Runs end at chunk boundaries or the
+// end of the file, so writing the runs out skips whole chunks of holes.
+static size_t file_next_data(const fs_object *obj, size_t pos, size_t *len) {
+    *len = 0;
+    if (pos >= obj->size) return obj->size;
+    if (file_unloaded(obj)) {
+        *len = obj->size - pos;
+        return pos;
+    }
+    if (obj->data_inline) {
+        if (pos >= INLINE_DATA_SIZE) return obj->size;
+        *len = (obj->size < INLINE_DATA_SIZE ? obj->size : INLINE_DATA_SIZE) - pos;
+        return pos;
+    }
+
+    // The next chunk is whichever comes first of an allocated chunk and one
+    // the mapped image covers.
+    size_t num_chunks = chunk_count(obj->size);
+    size_t index = pos >> CHUNK_SHIFT;
+    size_t next = num_chunks;
+    size_t e = file_extent_after(obj, index << CHUNK_SHIFT);
+    if (e < obj->num_extents) {
+        size_t first = obj->extents[e].offset >> CHUNK_SHIFT;
+        if (first < index) first = index;
+        if (first < num_chunks && (first << CHUNK_SHIFT) < obj->mapped_len) next = first;
+    }
+    for (size_t i = index; i < next && i < obj->max_chunks; i++) {
+        if (obj->chunks[i]) {
+            next = i;
+            break;
+        }
+    }
+    if (next == num_chunks) return obj->size;
+
+    size_t end = next + 1;
+    while (end < num_chunks && file_chunk_stored(obj, end)) end++;
+    size_t start = next << CHUNK_SHIFT > pos ? next << CHUNK_SHIFT : pos;
+    *len = (end < num_chunks ? end << CHUNK_SHIFT : obj->size) - start;
+    return start;
+}
+
+static int file_write(fs_object *obj, const char *buf, size_t size, off_t offset) {
+    size_t end = offset + size;
+    if (obj->data_inline) {
+        if (end <= INLINE_DATA_SIZE) {
+            memcpy(obj->inline_data + offset, buf, size);
+            if (end > obj->size) obj->size = end;
+            return 0;
+        }
+        int res = file_spill(obj);
+        if (res != 0) return res;
+    }
+
+    int res = file_reserve_chunks(obj, chunk_count(end));
+    if (res != 0) return res;
+
+    size_t done = 0;
+    while (done < size) {
+        size_t pos = offset + done;
+        size_t index = pos >> CHUNK_SHIFT;
+        size_t in_chunk = pos & (CHUNK_SIZE - 1);
+        size_t n = CHUNK_SIZE - in_chunk;
+        if (n > size - done) n = size - done;
+
+        res = file_prepare_chunk(obj, index, in_chunk + n);
+        if (res != 0) break;
+        memcpy(obj->chunks[index] + in_chunk, buf + done, n);
+        done += n;
+    }
+
+    // Whatever made it in is part of the file, even after a failure.
+    if (offset + done > obj->size) obj->size = offset + done;
+    return res;
+}
+
+// Take the lowest unused inode number; numbers freed by unlink and rmdir
+// are handed out again. Returns -EDQUOT when all max_inodes numbers are in
+// use and -ENOMEM when a new table segment can't be allocated.
+static int alloc_inode(void) {
+    pthread_mutex_lock(&fs_mutex);
+    int inode = inode_map_find();
+    if (inode < 0) {
+        inode = -EDQUOT;
+    } else if (inode_segment_alloc(inode) != 0) {
+        inode = -ENOMEM;
+    } else {
+        inode_map_take(inode);
+        if (inode >= num_fs_objects) num_fs_objects = inode + 1;
+    }
+    pthread_mutex_unlock(&fs_mutex);
+    return inode;
+}
+
+// Give back an inode whose object has been freed.
+static void release_inode(int inode) {
+    pthread_mutex_lock(&fs_mutex);
+    inode_map_put(inode);
+    pthread_mutex_unlock(&fs_mutex);
+}
+
+static bool dir_version_is(int inode, unsigned long version) {
+    return atomic_load_explicit(&fs_obj(inode)->version, memory_order_acquire) == version;
+}
+
+// Negative lookup cache keyed by (parent inode, name). A hit means the name
+// was recently looked up in that directory and was not there. create and
+// mkdir invalidate the name they add, and an entry is only trusted while
+// the parent's version is unchanged, so one filled during a racing create
+// is never served. Slots hold immutable entries swapped in atomically, so
+// lookups take no lock; replaced entries are retired through the epoch
+// scheme. It is direct-mapped and bounded at NEG_CACHE_SIZE entries.
+#define NEG_CACHE_SIZE 1024
+
+typedef struct {
+    unsigned int hash;
+    int parent;
+    unsigned long version;
+    char name[];
+} neg_cache_entry;
+
+static _Atomic(neg_cache_entry *) neg_cache[NEG_CACHE_SIZE];
+static atomic_ulong neg_cache_hits, neg_cache_invalidations;
+
+static unsigned int neg_cache_hash(int parent, const char *name) {
+    return name_hash(name) ^ ((unsigned int)parent * 2654435761u);
+}
+
+// Callers are inside an epoch.
+static bool neg_cache_lookup(int parent, const char *name) {
+    unsigned int hash = neg_cache_hash(parent, name);
+    neg_cache_entry *entry = atomic_load_explicit(&neg_cache[hash & (NEG_CACHE_SIZE - 1)], memory_order_acquire);
+    if (entry && entry->hash == hash && entry->parent == parent && strcmp(entry->name, name) == 0 &&
+        dir_version_is(parent, entry->version)) {
+        atomic_fetch_add_explicit(&neg_cache_hits, 1, memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+static void neg_cache_insert(int parent, const char *name, unsigned long version) {
+    size_t len = strlen(name);
+    neg_cache_entry *entry = pool_alloc(sizeof(neg_cache_entry) + len + 1);
+    if (!entry) return;  // the cache is only an optimization
+    entry->hash = neg_cache_hash(parent, name);
+    entry->parent = parent;
+    entry->version = version;
+    memcpy(entry->name, name, len + 1);
+
+    neg_cache_entry *old = atomic_exchange_explicit(&neg_cache[entry->hash & (NEG_CACHE_SIZE - 1)], entry, memory_order_acq_rel);
+    if (old) epoch_retire(old, pool_free);
+}
+
+static void neg_cache_invalidate(int parent, const char *name) {
+    unsigned int hash = neg_cache_hash(parent, name);
+    _Atomic(neg_cache_entry *) *slot = &neg_cache[hash & (NEG_CACHE_SIZE - 1)];
+
+    epoch_enter();
+    neg_cache_entry *entry = atomic_load_explicit(slot, memory_order_acquire);
+    if (entry && entry->hash == hash && entry->parent == parent && strcmp(entry->name, name) == 0 &&
+        atomic_compare_exchange_strong(slot, &entry, NULL)) {
+        epoch_retire(entry, pool_free);
+        atomic_fetch_add_explicit(&neg_cache_invalidations, 1, memory_order_relaxed);
+    }
+    epoch_exit();
+}
+
+static void lookup_cache_print_stats(void) {
+    printf("negative cache: %lu hits, %lu invalidations\n", atomic_load(&neg_cache_hits), atomic_load(&neg_cache_invalidations));
+}
+
+// The image is read in one streaming pass: objects are parsed straight off
+// a buffered file and built into the inode table as each one ends, so no
+// document tree is ever held in memory. Memory use beyond the file system
+// itself is bounded by the largest single object per loader thread. Any
+// syntax or consistency error ends the program with the byte offset it was
+// found at. Readers that decode file data once mounted (file_fetch) set
+// recoverable instead: an error is then recorded in the reader, which
+// reads as EOF from there on, and the decoder returns early.
+//
+// Large images are loaded by several threads (-o load_threads=N, default
+// one per CPU). A quick structural scan, which only tracks strings and
+// nesting, splits the top-level array into one slice of whole objects per
+// thread; each thread then parses its slice and builds the objects in it,
+// directory indexes included, straight into the shared inode table.
+#define IMAGE_READ_BUFFER_SIZE (64 * 1024)
+#define IMAGE_MIN_SLICE ((long)1 << 20)  // don't split images finer than this
+
+static int load_threads;  // 0: one per online CPU
+
+typedef struct {
+    int fd;
+    const char *filename;
+    long offset;      // file offset of buf[0]
+    long end;         // stop reading here
+    size_t pos, len;
+    int num_objects;  // highest inode slot touched + 1
+    bool recoverable;  // record errors instead of exiting
+    int error;         // first recorded error (an errno value), or 0
+    char buf[IMAGE_READ_BUFFER_SIZE];
+} image_reader;
+
+// A growable byte string. Strings are kept NUL-terminated.
+typedef struct {
+    char *data;
+    size_t len, cap;
+} image_buf;
+
+static void image_fail_with(image_reader *r, int error, const char *what) {
+    if (r->error) return;
+    fprintf(stderr, "%s: %s at byte %ld\n", r->filename, what, r->offset + (long)r->pos);
+    if (!r->recoverable) exit(1);
+    r->error = error;
+}
+
+static void image_fail(image_reader *r, const char *what) {
+    image_fail_with(r, EIO, what);
+}
+
+static void image_buf_append(image_reader *r, image_buf *b, const char *data, size_t len) {
+    if (b->len + len + 1 > b->cap) {
+        size_t new_cap = b->cap ? b->cap : 64;
+        while (new_cap < b->len + len + 1) new_cap *= 2;
+        char *new_data = realloc(b->data, new_cap);
+        if (!new_data) {
+            image_fail_with(r, ENOMEM, "out of memory");
+            return;
+        }
+        b->data = new_data;
+        b->cap = new_cap;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    b->data[b->len] = '\0';
+}
+
+// Next byte without consuming it, or EOF.
+static int image_peek(image_reader *r) {
+    if (r->error) return EOF;
+    if (r->pos == r->len) {
+        r->offset += r->len;
+        r->pos = 0;
+        size_t want = r->end - r->offset < (long)sizeof(r->buf) ? (size_t)(r->end - r->offset) : sizeof(r->buf);
+        ssize_t n = want ? pread(r->fd, r->buf, want, r->offset) : 0;
+        if (n < 0) {
+            image_fail(r, strerror(errno));
+            return EOF;
+        }
+        r->len = n;
+        if (r->len == 0) return EOF;
+    }
+    return (unsigned char)r->buf[r->pos];
+}
+
+static int image_get(image_reader *r) {
+    int c = image_peek(r);
+    if (c != EOF) r->pos++;
+    return c;
+}
+
+// Skip whitespace and peek at the byte after it.
+static int image_skip_ws(image_reader *r) {
+    int c;
+    while ((c = image_peek(r)) == ' ' || c == '\n' || c == '\r' || c == '\t') {
+        r->pos++;
+    }
+    return c;
+}
+
+static void image_expect(image_reader *r, char expected) {
+    if (image_skip_ws(r) != expected) {
+        char what[32];
+        snprintf(what, sizeof(what), "expected '%c'", expected);
+        image_fail(r, what);
+        return;
+    }
+    r->pos++;
+}
+
+// Call after the opening bracket of an array or object and before every
+// element: returns false, consuming the closing bracket, when there are no
+// more elements. *first tracks whether a separating comma is needed.
+static bool image_more(image_reader *r, char close, bool *first) {
+    int c = image_skip_ws(r);
+    if (c == close) {
+        r->pos++;
+        return false;
+    }
+    if (!*first) {
+        if (c != ',') image_fail(r, "expected ','");
+        r->pos++;
+    }
+    *first = false;
+    return true;
+}
+
+static int image_hex4(image_reader *r) {
+    int value = 0;
+    for (int i = 0; i < 4; i++) {
+        int c = image_get(r);
+        value <<= 4;
+        if (c >= '0' && c <= '9') value |= c - '0';
+        else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+        else image_fail(r, "bad \\u escape");
+    }
+    return value;
+}
+
+static void image_string_keep(image_reader *r, image_buf *out, size_t limit, const char *data, size_t len) {
+    if (!out || out->len >= limit) return;
+    image_buf_append(r, out, data, len < limit - out->len ? len : limit - out->len);
+}
+
+// Decode a string into out (replacing its contents), keeping at most limit
+// bytes of it, and return its decoded length. out may be NULL to only
+// measure the string. Runs of plain bytes are copied straight from the
+// read buffer, so large file data costs little more than a memcpy.
+static size_t image_string_prefix(image_reader *r, image_buf *out, size_t limit) {
+    size_t length = 0;
+    image_expect(r, '"');
+    if (out) {
+        out->len = 0;
+        image_buf_append(r, out, "", 0);  // always NUL-terminated
+    }
+    for (;;) {
+        if (image_peek(r) == EOF) {
+            image_fail(r, "unterminated string");
+            return length;
+        }
+
+        size_t run = r->pos;
+        while (run < r->len && r->buf[run] != '"' && r->buf[run] != '\\') run++;
+        image_string_keep(r, out, limit, r->buf + r->pos, run - r->pos);
+        length += run - r->pos;
+        r->pos = run;
+        if (run == r->len) continue;
+
+        if (image_get(r) == '"') break;
+
+        char decoded[4];
+        size_t n = 1;
+        int c = image_get(r);
+        switch (c) {
+        case '"': case '\\': case '/': decoded[0] = c; break;
+        case 'b': decoded[0] = '\b'; break;
+        case 'f': decoded[0] = '\f'; break;
+        case 'n': decoded[0] = '\n'; break;
+        case 'r': decoded[0] = '\r'; break;
+        case 't': decoded[0] = '\t'; break;
+        case 'u': {
+            // Code points below 0x80, which is how json-c writes control
+            // bytes in file data, decode to the byte itself; others to UTF-8.
+            unsigned int cp = image_hex4(r);
+            if (cp >= 0xd800 && cp < 0xdc00 && image_get(r) == '\\' && image_get(r) == 'u') {
+                unsigned int low = image_hex4(r);
+                if (low < 0xdc00 || low > 0xdfff) image_fail(r, "bad surrogate pair");
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            } else if (cp >= 0xd800 && cp < 0xe000) {
+                image_fail(r, "bad surrogate pair");
+            }
+            if (cp < 0x80) {
+                decoded[0] = cp;
+            } else if (cp < 0x800) {
+                decoded[0] = 0xc0 | (cp >> 6);
+                decoded[1] = 0x80 | (cp & 0x3f);
+                n = 2;
+            } else if (cp < 0x10000) {
+                decoded[0] = 0xe0 | (cp >> 12);
+                decoded[1] = 0x80 | ((cp >> 6) & 0x3f);
+                decoded[2] = 0x80 | (cp & 0x3f);
+                n = 3;
+            } else {
+                decoded[0] = 0xf0 | (cp >> 18);
+                decoded[1] = 0x80 | ((cp >> 12) & 0x3f);
+                decoded[2] = 0x80 | ((cp >> 6) & 0x3f);
+                decoded[3] = 0x80 | (cp & 0x3f);
+                n = 4;
+            }
+            break;
+        }
+        default:
+            image_fail(r, "bad escape");
+        }
+        if (r->error) return length;
+        image_string_keep(r, out, limit, decoded, n);
+        length += n;
+    }
+    return length;
+}
+
+// Decode a string into out, or skip it if out is NULL.
+static void image_string(image_reader *r, image_buf *out) {
+    image_string_prefix(r, out, SIZE_MAX);
+}
+
+static int image_int(image_reader *r) {
+    int c = image_skip_ws(r);
+    bool negative = c == '-';
+    if (negative) r->pos++;
+
+    long long value = 0;
+    int digits = 0;
+    while ((c = image_peek(r)) >= '0' && c <= '9') {
+        value = value * 10 + (c - '0');
+        if (value > INT_MAX) image_fail(r, "number out of range");
+        r->pos++;
+        digits++;
+    }
+    if (digits == 0) image_fail(r, "expected an integer");
+    return negative ? -(int)value : (int)value;
+}
+
+// Skip over a value of any kind, for keys the loader doesn't know.
+static void image_skip_value(image_reader *r) {
+    int c = image_skip_ws(r);
+    bool first = true;
+    if (c == '"') {
+        image_string(r, NULL);
+    } else if (c == '[') {
+        r->pos++;
+        while (image_more(r, ']', &first)) image_skip_value(r);
+    } else if (c == '{') {
+        r->pos++;
+        while (image_more(r, '}', &first)) {
+            image_string(r, NULL);
+            image_expect(r, ':');
+            image_skip_value(r);
+        }
+    } else if (c != EOF && strchr("-0123456789truefalsn", c)) {
+        // Numbers and literals: everything up to the next delimiter.
+        while ((c = image_peek(r)) != EOF && !strchr(",]} \n\r\t", c)) r->pos++;
+    } else {
+        image_fail(r, "expected a value");
+    }
+}
+
+// One object of the image, collected until its closing brace because its
+// keys may come in any order.
+typedef struct {
+    int inode;
+    fs_type type;
+    bool has_name, has_data;
+    image_buf name, data;  // data: only files of up to INLINE_DATA_SIZE bytes
+    long data_offset, data_end;  // the encoded data string
+    size_t data_size;
+    image_buf entry_names;  // NUL-separated
+    int *entry_inodes;
+    int num_entries, max_entries;
+} image_object;
+
+static void image_entry(image_reader *r, image_object *o, image_buf *key) {
+    int inode = -1;
+    bool has_name = false;
+    bool first = true;
+
+    image_expect(r, '{');
+    while (image_more(r, '}', &first)) {
+        image_string(r, key);
+        image_expect(r, ':');
+        if (strcmp(key->data, "inode") == 0) {
+            inode = image_int(r);
+        } else if (strcmp(key->data, "name") == 0 && !has_name) {
+            image_string(r, key);  // done with the key, reuse its buffer
+            image_buf_append(r, &o->entry_names, key->data, key->len + 1);
+            has_name = true;
+        } else {
+            image_skip_value(r);
+        }
+    }
+    if (inode < 0 || inode >= max_inodes) image_fail(r, "invalid entry inode");
+    if (!has_name) return;  // nothing to link it under
+
+    if (o->num_entries == o->max_entries) {
+        int new_max = o->max_entries ? o->max_entries * 2 : 16;
+        int *new_inodes = realloc(o->entry_inodes, new_max * sizeof(int));
+        if (!new_inodes) image_fail(r, "out of memory");
+        o->entry_inodes = new_inodes;
+        o->max_entries = new_max;
+    }
+    o->entry_inodes[o->num_entries++] = inode;
+}
+
+static fs_object *image_slot(image_reader *r, int inode) {
+    if (inode_segment_alloc(inode) != 0) image_fail(r, "out of memory");
+    if (inode >= r->num_objects) r->num_objects = inode + 1;
+    return fs_obj(inode);
+}
+
+// Build the parsed object into the inode table. Other loader threads may
+// be building other objects at the same time: claiming the slot by
+// swapping its type is what makes it ours, and link counts, which any
+// thread may bump, are updated atomically.
+static void image_build(image_reader *r, image_object *o) {
+    if (o->inode < 0 || o->inode >= max_inodes) image_fail(r, "invalid inode number");
+    if (o->type == FS_FREE) image_fail(r, "unknown type");
+
+    fs_object *obj = image_slot(r, o->inode);
+    if (__atomic_exchange_n(&obj->type, o->type, __ATOMIC_RELAXED) != FS_FREE) image_fail(r, "duplicate inode number");
+    obj->inode = o->inode;
+    obj->name = o->has_name ? strdup(o->name.data) : NULL;
+
+    if (obj->type == FS_REG) {
+        // Only small files are loaded now; the rest wait for file_load.
+        if (o->has_data && o->data_size > INLINE_DATA_SIZE) {
+            file_init_lazy(obj, o->data_offset, o->data_end - o->data_offset, o->data_size);
+            return;
+        }
+        file_init_data(obj);
+        if (o->has_data && o->data.len > 0 && file_write(obj, o->data.data, o->data.len, 0) != 0) {
+            image_fail(r, "out of memory for file data");
+        }
+        return;
+    }
+
+    obj->dir = dir_new_sized(o->num_entries);
+    if (!obj->dir) image_fail(r, "out of memory");
+    const char *name = o->entry_names.data;
+    for (int i = 0; i < o->num_entries; i++) {
+        int res = dir_add(obj, name, o->entry_inodes[i]);
+        if (res == -ENOSPC) image_fail(r, "too many files in a directory");
+        if (res != 0) image_fail(r, "out of memory");
+        __atomic_fetch_add(&image_slot(r, o->entry_inodes[i])->nlink, 1, __ATOMIC_RELAXED);
+        name += strlen(name) + 1;
+    }
+}
+
+static void image_object_parse(image_reader *r, image_object *o, image_buf *key, image_buf *value) {
+    o->inode = -1;
+    o->type = FS_FREE;
+    o->has_name = o->has_data = false;
+    o->entry_names.len = 0;
+    o->num_entries = 0;
+
+    bool first = true;
+    image_expect(r, '{');
+    while (image_more(r, '}', &first)) {
+        image_string(r, key);
+        image_expect(r, ':');
+        if (strcmp(key->data, "inode") == 0) {
+            o->inode = image_int(r);
+        } else if (strcmp(key->data, "type") == 0) {
+            image_string(r, value);
+            o->type = fs_type_from_name(value->data);
+        } else if (strcmp(key->data, "name") == 0) {
+            image_string(r, &o->name);
+            o->has_name = true;
+        } else if (strcmp(key->data, "data") == 0) {
+            image_skip_ws(r);
+            o->data_offset = r->offset + r->pos;
+            o->data_size = image_string_prefix(r, &o->data, INLINE_DATA_SIZE);
+            o->data_end = r->offset + r->pos;
+            o->has_data = true;
+        } else if (strcmp(key->data, "entries") == 0) {
+            bool first_entry = true;
+            image_expect(r, '[');
+            while (image_more(r, ']', &first_entry)) image_entry(r, o, key);
+        } else {
+            image_skip_value(r);
+        }
+    }
+}
+
+// Find where each of num_slices slices of the top-level array starts: the
+// first element at or after its share of the file. starts[0] is the first
+// element. Only strings and nesting are tracked; anything malformed is left
+// for the parser to report. Returns how many slices were found (fewer than
+// asked if the array has few elements), or 0 for an empty array.
+static int image_split(image_reader *r, int num_slices, long *starts) {
+    image_expect(r, '[');
+    if (image_skip_ws(r) == ']') {
+        r->pos++;
+        return 0;
+    }
+    starts[0] = r->offset + r->pos;
+
+    int found = 1;
+    int depth = 0;
+    bool in_string = false, escaped = false, after_comma = false;
+    while (found < num_slices) {
+        int c = image_peek(r);
+        if (c == EOF) break;
+
+        if (in_string) {
+            // Skip the bulk of a string in one go.
+            char *p = r->buf + r->pos, *end = r->buf + r->len;
+            if (escaped) {
+                escaped = false;
+                r->pos++;
+                continue;
+            }
+            while (p < end && *p != '"' && *p != '\\') p++;
+            r->pos = p - r->buf;
+            if (p == end) continue;
+            if (*p == '\\') escaped = true;
+            else in_string = false;
+            r->pos++;
+            continue;
+        }
+
+        if (after_comma && c != ' ' && c != '\n' && c != '\r' && c != '\t') {
+            after_comma = false;
+            long start = r->offset + r->pos;
+            if (start >= r->end / num_slices * found) starts[found++] = start;
+        }
+        if (c == '"') in_string = true;
+        else if (c == '{' || c == '[') depth++;
+        else if (c == '}' || c == ']') depth--;
+        else if (c == ',' && depth == 0) after_comma = true;
+        r->pos++;
+    }
+    return found;
+}
+
+typedef struct {
+    image_reader *r;
+    bool last;  // the slice that ends with the closing bracket
+} image_slice;
+
+// Parse the objects in one slice, which starts at the first byte of an
+// element and ends just before the first byte of the next slice's.
+static void *image_load_slice(void *arg) {
+    image_slice *slice = arg;
+    image_reader *r = slice->r;
+    image_object o = { 0 };
+    image_buf key = { 0 }, value = { 0 };
+
+    for (;;) {
+        image_object_parse(r, &o, &key, &value);
+        image_build(r, &o);
+
+        int c = image_skip_ws(r);
+        if (c == ',') {
+            r->pos++;
+            if (image_skip_ws(r) == EOF && !slice->last) break;
+        } else if (c == ']' && slice->last) {
+            r->pos++;
+            if (image_skip_ws(r) != EOF) image_fail(r, "trailing data after the image");
+            break;
+        } else {
+            image_fail(r, slice->last ? "expected ',' or ']'" : "expected ','");
+        }
+    }
+
+    free(o.name.data);
+    free(o.data.data);
+    free(o.entry_names.data);
+    free(o.entry_inodes);
+    free(key.data);
+    free(value.data);
+    return NULL;
+}
+
+static image_reader *image_reader_new(int fd, const char *filename, long start, long end) {
+    image_reader *r = malloc(sizeof(image_reader));
+    if (!r) {
+        fprintf(stderr, "Failed to allocate the image reader\n");
+        exit(1);
+    }
+    r->fd = fd;
+    r->filename = filename;
+    r->offset = start;
+    r->end = end;
+    r->pos = r->len = 0;
+    r->num_objects = 0;
+    r->recoverable = false;
+    r->error = 0;
+    return r;
+}
+
+// Files from a JSON image are loaded on demand. At mount only their size
+// and the position of their data string in the image are recorded; the
+// first read, write or truncate decodes the string into chunks. Files that
+// are loaded but still match the image are clean and can be dropped again:
+// they are kept on a list and, once their total size passes data_cache_limit
+// (-o data_cache=MiB), a clock sweep over the list unloads the ones that
+// have not been read since its last pass. Writing to a file detaches it from
+// the image for good. The image stays open for as long as the file system
+// is mounted and must not be modified in place meanwhile.
+#define DEFAULT_DATA_CACHE_MB 256
+
+static int data_image_fd = -1;
+static const char *data_image_name;
+
+static pthread_mutex_t data_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static fs_object *data_cache_hand;  // next to look at; the list is circular
+static size_t data_cache_used;
+static size_t data_cache_limit = (size_t)DEFAULT_DATA_CACHE_MB << 20;
+
+// Decode the data of an image-backed file into out. Errors are returned,
+// not fatal: this runs on a mounted file system.
+static int file_fetch(const fs_object *obj, image_buf *out) {
+    image_reader *r = malloc(sizeof(image_reader));
+    if (!r) return -ENOMEM;
+    r->fd = data_image_fd;
+    r->filename = data_image_name;
+    r->offset = obj->image_offset;
+    r->end = obj->image_offset + obj->image_len;
+    r->pos = r->len = 0;
+    r->recoverable = true;
+    r->error = 0;
+    size_t size = image_string_prefix(r, out, SIZE_MAX);
+    int res = r->error ? -r->error : size == obj->size ? 0 : -EIO;
+    free(r);
+    return res;
+}
+
+static void data_cache_unlink(fs_object *obj) {
+    if (obj->cache_next == obj) {
+        data_cache_hand = NULL;
+    } else {
+        obj->cache_prev->cache_next = obj->cache_next;
+        obj->cache_next->cache_prev = obj->cache_prev;
+        if (data_cache_hand == obj) data_cache_hand = obj->cache_next;
+    }
+    obj->cache_prev = obj->cache_next = NULL;
+    data_cache_used -= obj->size;
+}
+
+// Drop the data of a clean loaded file. The caller holds its write lock and
+// data_cache_mutex.
+static void file_unload(fs_object *obj) {
+    data_cache_unlink(obj);
+    off_t offset = obj->image_offset;
+    size_t len = obj->image_len, size = obj->size;
+    file_free_data(obj);
+    file_init_lazy(obj, offset, len, size);
+}
+
+// Unload files until the cache is back under its limit. Skips except (the
+// file just loaded), files read since the last pass and files someone else
+// has locked; gives up after two laps.
+static void data_cache_evict(fs_object *except) {
+    pthread_mutex_lock(&data_cache_mutex);
+    size_t budget = 0;
+    for (fs_object *obj = data_cache_hand; obj; obj = obj->cache_next) {
+        budget += 2;
+        if (obj->cache_next == data_cache_hand) break;
+    }
+    while (data_cache_used > data_cache_limit && data_cache_hand && budget-- > 0) {
+        fs_object *obj = data_cache_hand;
+        data_cache_hand = obj->cache_next;
+        if (obj == except) continue;
+        if (__atomic_exchange_n(&obj->image_referenced, false, __ATOMIC_RELAXED)) continue;
+        if (pthread_rwlock_trywrlock(&obj->lock) != 0) continue;
+        file_unload(obj);
+        pthread_rwlock_unlock(&obj->lock);
+    }
+    pthread_mutex_unlock(&data_cache_mutex);
+}
+
+// Make sure the file's data is in memory. The caller holds its write lock.
+static int file_load(fs_object *obj) {
+    if (!file_unloaded(obj)) return 0;
+
+    image_buf data = { 0 };
+    int res = file_fetch(obj, &data);
+    if (res == 0) res = file_write(obj, data.data, data.len, 0);
+    free(data.data);
+    if (res != 0) {
+        off_t offset = obj->image_offset;
+        size_t len = obj->image_len, size = obj->size;
+        file_free_data(obj);
+        file_init_lazy(obj, offset, len, size);
+        return res;
+    }
+
+    obj->image_loaded = true;
+    obj->image_referenced = true;
+    pthread_mutex_lock(&data_cache_mutex);
+    if (data_cache_hand) {
+        // Insert just behind the hand, so the sweep reaches it last.
+        obj->cache_next = data_cache_hand;
+        obj->cache_prev = data_cache_hand->cache_prev;
+        obj->cache_prev->cache_next = obj;
+        data_cache_hand->cache_prev = obj;
+    } else {
+        obj->cache_prev = obj->cache_next = obj;
+        data_cache_hand = obj;
+    }
+    data_cache_used += obj->size;
+    bool over = data_cache_used > data_cache_limit;
+    pthread_mutex_unlock(&data_cache_mutex);
+
+    if (over) data_cache_evict(obj);
+    return 0;
+}
+
+// Forget that the file came from the image, ahead of a change to it. The
+// caller holds its write lock and has loaded it.
+static void file_detach_image(fs_object *obj) {
+    if (!obj->image_len) return;
+    if (obj->image_loaded) {
+        pthread_mutex_lock(&data_cache_mutex);
+        data_cache_unlink(obj);
+        pthread_mutex_unlock(&data_cache_mutex);
+    }
+    obj->image_len = 0;
+    obj->image_loaded = false;
+}
+
+// Set up the empty inode table for a loader.
+static void load_begin(void) {
+    num_inode_segments = (max_inodes + INODE_SEGMENT_SIZE - 1) >> INODE_SEGMENT_SHIFT;
+    inode_segments = calloc(num_inode_segments, sizeof(*inode_segments));
+    if (!inode_segments) {
+        fprintf(stderr, "Failed to allocate the inode table\n");
+        exit(1);
+    }
+}
+
+// Check the loaded table and set up inode allocation. Entries may name
+// inodes that come later in an image, so they are only checked once
+// everything is in.
+static void load_finish(const char *filename) {
+    for (int i = 0; i < num_fs_objects; i++) {
+        if (fs_obj(i)->type == FS_FREE && fs_obj(i)->nlink > 0) {
+            fprintf(stderr, "%s: directory entry for missing inode %d\n", filename, i);
+            exit(1);
+        }
+    }
+
+    if (inode_map_init(max_inodes) != 0) {
+        fprintf(stderr, "Failed to allocate the inode bitmap\n");
+        exit(1);
+    }
+    for (int i = 0; i < num_fs_objects; i++) {
+        if (fs_obj(i)->type != FS_FREE) inode_map_take(i);
+    }
+}
+
+static void load_json_fs(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to load JSON filesystem from %s\n", filename);
+        exit(1);
+    }
+    load_begin();
+
+    int num_threads = load_threads > 0 ? load_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads > st.st_size / IMAGE_MIN_SLICE) num_threads = st.st_size / IMAGE_MIN_SLICE;
+    if (num_threads < 1) num_threads = 1;
+
+    long *starts = malloc((num_threads + 1) * sizeof(long));
+    image_slice *slices = malloc(num_threads * sizeof(image_slice));
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    if (!starts || !slices || !threads) {
+        fprintf(stderr, "Failed to allocate the image reader\n");
+        exit(1);
+    }
+    image_reader *scan = image_reader_new(fd, filename, 0, st.st_size);
+    int num_slices = image_split(scan, num_threads, starts);
+    if (num_slices == 0 && image_skip_ws(scan) != EOF) image_fail(scan, "trailing data after the image");
+    free(scan);
+    starts[num_slices] = st.st_size;
+
+    // Objects are stored at fs_obj(inode). Images saved after unlinks have
+    // holes; those slots stay FS_FREE.
+    pthread_mutex_lock(&fs_mutex);
+    for (int i = 0; i < num_slices; i++) {
+        slices[i].r = image_reader_new(fd, filename, starts[i], starts[i + 1]);
+        slices[i].last = i == num_slices - 1;
+        if (i > 0 && pthread_create(&threads[i], NULL, image_load_slice, &slices[i]) != 0) {
+            fprintf(stderr, "Failed to start loader thread\n");
+            exit(1);
+        }
+    }
+    if (num_slices > 0) image_load_slice(&slices[0]);
+
+    num_fs_objects = 0;
+    for (int i = 0; i < num_slices; i++) {
+        if (i > 0) pthread_join(threads[i], NULL);
+        if (slices[i].r->num_objects > num_fs_objects) num_fs_objects = slices[i].r->num_objects;
+        free(slices[i].r);
+    }
+    free(starts);
+    free(slices);
+    free(threads);
+
+    // Kept open for file_load.
+    data_image_fd = fd;
+    data_image_name = filename;
+
+    load_finish(filename);
+    pthread_mutex_unlock(&fs_mutex);
+}
+
+// Binary images are an alternative to JSON that is mounted by mapping the
+// file instead of parsing it:
+//
+//   header | inode records | directory entries | file extents | string table | file data
+//
+// Inode records are fixed-size and carry their inode number; unused
+// numbers have no record. A directory's entries are a contiguous run of
+// the entry array, in listing order, and a regular file's extents
+// (file_extent) a run of the extent array, in file order. Names are
+// NUL-terminated strings in the string table, referenced by offset. The
+// data region holds the stored bytes of every regular file back to back
+// and starts on a page boundary; holes take up no space. Mounting builds the inode table and directory indexes from the
+// records but leaves file data in the mapping (see file_init_mapped), so
+// mount time grows with the number of objects and not with their size.
+// Integers are in host byte order. Version 2 images had no extent table,
+// and each file's bytes were all stored from the record's start; they are
+// still read.
+//
+// A partial image (BINARY_IMAGE_PARTIAL) holds only some inodes and is
+// applied on top of a loaded file system: each record replaces its inode,
+// and FS_FREE records delete theirs. Checkpoints are written this way.
+#define BINARY_IMAGE_MAGIC "JSONFSB1"
+#define BINARY_IMAGE_VERSION 3
+#define BINARY_IMAGE_PARTIAL 1
+#define BINARY_IMAGE_NO_NAME UINT64_MAX
+#define BINARY_IMAGE_DATA_ALIGN 4096
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t num_records;
+    uint64_t num_entries;
+    uint64_t records_offset;
+    uint64_t entries_offset;
+    uint64_t strings_offset, strings_size;
+    uint64_t data_offset, data_size;
+    uint64_t extents_offset, num_extents;  // not in version 2
+} binary_image_header;
+
+typedef struct {
+    uint32_t inode;
+    uint32_t type;         // fs_type
+    uint32_t num_entries;  // FS_DIR: entries; FS_REG: extents
+    uint32_t pad;
+    uint64_t name;         // string table offset, or BINARY_IMAGE_NO_NAME
+    uint64_t size;         // FS_REG
+    uint64_t start;        // index of the first entry or extent (version 2 FS_REG: offset into the data region)
+} binary_image_record;
+
+typedef struct {
+    uint64_t name;  // string table offset
+    uint32_t inode;
+    uint32_t pad;
+} binary_image_entry;
+
+static bool is_binary_image(const char *filename) {
+    char magic[8];
+    FILE *f = fopen(filename, "rb");
+    if (!f) return false;
+    bool match = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, BINARY_IMAGE_MAGIC, sizeof(magic)) == 0;
+    fclose(f);
+    return match;
+}
+
+static void binary_image_fail(const char *filename, const char *what) {
+    fprintf(stderr, "%s: %s\n", filename, what);
+    exit(1);
+}
+
+// Map an image and check its layout. The mapping is never unmapped: files
+// keep reading from it until every chunk has been rewritten.
+static const binary_image_header *binary_image_map(const char *filename, bool partial) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to load binary image from %s\n", filename);
+        exit(1);
+    }
+    if ((size_t)st.st_size < offsetof(binary_image_header, extents_offset)) binary_image_fail(filename, "truncated header");
+    const char *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) binary_image_fail(filename, strerror(errno));
+
+    // Check the layout before trusting any offset in it.
+    uint64_t file_size = st.st_size;
+    const binary_image_header *h = (const binary_image_header *)base;
+    if (memcmp(h->magic, BINARY_IMAGE_MAGIC, sizeof(h->magic)) != 0) binary_image_fail(filename, "not a binary image");
+    if (h->version != BINARY_IMAGE_VERSION && h->version != 2) binary_image_fail(filename, "unsupported image version");
+    if (h->version != 2 && file_size < sizeof(binary_image_header)) binary_image_fail(filename, "truncated header");
+    if (!!(h->flags & BINARY_IMAGE_PARTIAL) != partial) binary_image_fail(filename, partial ? "not a checkpoint" : "a checkpoint, not an image");
+    if (h->version != 2 &&
+        (h->extents_offset % 8 || h->extents_offset > file_size ||
+         h->num_extents > (file_size - h->extents_offset) / sizeof(file_extent))) {
+        binary_image_fail(filename, "corrupt layout");
+    }
+    if (h->records_offset % 8 || h->entries_offset % 8 ||
+        h->records_offset > file_size || h->num_records > (file_size - h->records_offset) / sizeof(binary_image_record) ||
+        h->entries_offset > file_size || h->num_entries > (file_size - h->entries_offset) / sizeof(binary_image_entry) ||
+        h->strings_offset > file_size || h->strings_size > file_size - h->strings_offset ||
+        h->data_offset > file_size || h->data_size > file_size - h->data_offset) {
+        binary_image_fail(filename, "corrupt layout");
+    }
+    const char *strings = base + h->strings_offset;
+    // With the table terminated, any offset inside it starts a terminated string.
+    if (h->strings_size > 0 && strings[h->strings_size - 1] != '\0') binary_image_fail(filename, "corrupt string table");
+    return h;
+}
+
+// Build the records of a mapped image into the inode table. Link counts
+// are left to load_count_links. The caller holds fs_mutex.
+static void binary_image_apply(const binary_image_header *h, const char *filename) {
+    const char *base = (const char *)h;
+    const binary_image_record *records = (const void *)(base + h->records_offset);
+    const binary_image_entry *entries = (const void *)(base + h->entries_offset);
+    const char *strings = base + h->strings_offset;
+    const file_extent *extents = h->version != 2 ? (const void *)(base + h->extents_offset) : NULL;
+    const char *data = base + h->data_offset;
+    bool partial = h->flags & BINARY_IMAGE_PARTIAL;
+    // Version 2: one extent per file, built here and kept as long as the mapping.
+    file_extent *dense = NULL;
+    if (h->version == 2 && h->num_records > 0) {
+        dense = calloc(h->num_records, sizeof(file_extent));
+        if (!dense) binary_image_fail(filename, "out of memory");
+    }
+
+    for (uint64_t i = 0; i < h->num_records; i++) {
+        const binary_image_record *rec = &records[i];
+        if (rec->inode >= (uint32_t)max_inodes) binary_image_fail(filename, "more inodes than max_inodes");
+        if (rec->type != FS_REG && rec->type != FS_DIR && !(partial && rec->type == FS_FREE)) binary_image_fail(filename, "unknown type");
+        if (rec->name != BINARY_IMAGE_NO_NAME && rec->name >= h->strings_size) binary_image_fail(filename, "corrupt name");
+        if (inode_segment_alloc(rec->inode) != 0) binary_image_fail(filename, "out of memory");
+        if ((int)rec->inode >= num_fs_objects) num_fs_objects = rec->inode + 1;
+
+        fs_object *obj = fs_obj(rec->inode);
+        if (obj->type != FS_FREE) {
+            if (!partial) binary_image_fail(filename, "duplicate inode number");
+            free_fs_object(obj);
+        }
+        if (rec->type == FS_FREE) continue;
+        obj->inode = rec->inode;
+        obj->type = rec->type;
+        obj->name = rec->name != BINARY_IMAGE_NO_NAME ? strdup(strings + rec->name) : NULL;
+
+        if (obj->type == FS_REG) {
+            const file_extent *file_extents;
+            uint64_t num_extents = rec->num_entries;
+            if (dense) {
+                dense[i] = (file_extent){ .len = rec->size, .start = rec->start };
+                file_extents = &dense[i];
+                num_extents = rec->size > 0;
+            } else {
+                if (rec->start > h->num_extents || num_extents > h->num_extents - rec->start) binary_image_fail(filename, "corrupt file");
+                file_extents = &extents[rec->start];
+            }
+            // Sorted, chunk-aligned, inside the file and inside the data region.
+            uint64_t end = 0;
+            for (uint64_t j = 0; j < num_extents; j++) {
+                const file_extent *e = &file_extents[j];
+                if (e->offset % CHUNK_SIZE || e->offset < end || e->len == 0 ||
+                    e->offset > rec->size || e->len > rec->size - e->offset ||
+                    e->start > h->data_size || e->len > h->data_size - e->start) {
+                    binary_image_fail(filename, "corrupt file extent");
+                }
+                end = e->offset + e->len;
+            }
+            file_init_mapped(obj, data, file_extents, num_extents, rec->size);
+            continue;
+        }
+
+        if (rec->start > h->num_entries || rec->num_entries > h->num_entries - rec->start) binary_image_fail(filename, "corrupt directory");
+        obj->dir = dir_new_sized(rec->num_entries);
+        if (!obj->dir) binary_image_fail(filename, "out of memory");
+        for (uint32_t j = 0; j < rec->num_entries; j++) {
+            const binary_image_entry *entry = &entries[rec->start + j];
+            if (entry->name >= h->strings_size || entry->inode >= (uint32_t)max_inodes) binary_image_fail(filename, "corrupt directory entry");
+            if (inode_segment_alloc(entry->inode) != 0) binary_image_fail(filename, "out of memory");
+            int res = dir_add(obj, strings + entry->name, entry->inode);
+            if (res == -ENOSPC) binary_image_fail(filename, "too many files in a directory");
+            if (res != 0) binary_image_fail(filename, "out of memory");
+        }
+    }
+}
+
+// Recount every link from the directory entries. Entries may name
+// inodes past num_fs_objects that were never created; load_finish
+// reports those.
+static void load_count_links(void) {
+    int num_objects = num_fs_objects;
+    for (int i = 0; i < num_inode_segments; i++) {
+        if (!atomic_load_explicit(&inode_segments[i], memory_order_relaxed)) continue;
+        for (int j = 0; j < INODE_SEGMENT_SIZE; j++) {
+            fs_obj(i * INODE_SEGMENT_SIZE + j)->nlink = 0;
+        }
+    }
+    for (int i = 0; i < num_objects; i++) {
+        fs_object *obj = fs_obj(i);
+        if (obj->type != FS_DIR) continue;
+        for (int c = 0; c < obj->dir->num_chunks; c++) {
+            const fs_dir_chunk *chunk = obj->dir->chunks[c];
+            for (int j = 0; j < chunk->count; j++) {
+                int inode = chunk->entries[j]->inode;
+                fs_obj(inode)->nlink++;
+                if (inode >= num_fs_objects) num_fs_objects = inode + 1;
+            }
+        }
+    }
+}
+
+static void load_binary_image(const char *filename) {
+    const binary_image_header *h = binary_image_map(filename, false);
+    pthread_mutex_lock(&fs_mutex);
+    load_begin();
+    binary_image_apply(h, filename);
+    load_count_links();
+    load_finish(filename);
+    pthread_mutex_unlock(&fs_mutex);
+}
+
+// Snapshots give savers a point-in-time view of the whole file system
+// while the FUSE callbacks keep changing it. Taking one only pauses
+// writers for a moment: it stops them at an operation boundary, assigns
+// the snapshot the next generation number and records how many inode
+// slots there are. Nothing is copied then. Instead, the first time a
+// writer changes an object after a snapshot, it freezes a copy of the
+// object's old state into every active snapshot that needs one
+// (snapshot_preserve). A saver reads each inode from the snapshot's copy
+// if there is one, and from the live object otherwise, which then still
+// holds the state as of the snapshot.
+//
+// A frozen copy is cheap: a file shares its chunks with the live one
+// (which copies a chunk before writing it), points at the same mapped or
+// JSON image data, and only a directory's listing is copied. Copies are
+// shared by all the snapshots taken before the change and freed with
+// the last of them.
+//
+// Operations that change the file system hold change_lock shared around
+// the change and its journal record; taking a snapshot holds it
+// exclusively. The lock prefers writers, so a steady stream of
+// operations can't hold a snapshot off.
+typedef struct {
+    atomic_int refs;  // snapshots holding this copy
+    fs_object obj;    // its lock is unused: a copy never changes
+} snapshot_object;
+
+typedef struct snapshot {
+    unsigned long gen;
+    int num_objects;  // slots [0, num_objects) existed when it was taken
+    // Frozen copies by inode, in segments of INODE_SEGMENT_SIZE allocated
+    // as needed. Entries are written under the object's write lock.
+    _Atomic(snapshot_object **) *saved;
+    bool failed;      // out of memory while preserving; the view is incomplete
+    struct snapshot *next;
+} snapshot;
+
+static pthread_rwlock_t change_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+// Active snapshots and the generation counter. snapshot_gen only changes
+// with change_lock held exclusively.
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static snapshot *snapshots;
+static atomic_int num_snapshots;
+static unsigned long snapshot_gen;
+
+// Stands for a slot that was free when the snapshot was taken.
+static snapshot_object snapshot_free_slot = { .obj = { .type = FS_FREE } };
+
+// Bracket an operation that changes the file system. Outermost lock.
+static void change_begin(void) {
+    pthread_rwlock_rdlock(&change_lock);
+}
+
+static void change_end(void) {
+    pthread_rwlock_unlock(&change_lock);
+}
+
+// Take a snapshot. The caller holds change_lock exclusively.
+static snapshot *snapshot_take_locked(void) {
+    snapshot *s = calloc(1, sizeof(snapshot));
+    if (s) s->saved = calloc(num_inode_segments, sizeof(*s->saved));
+    if (!s || !s->saved) {
+        free(s);
+        return NULL;
+    }
+    pthread_mutex_lock(&fs_mutex);
+    s->num_objects = num_fs_objects;
+    pthread_mutex_unlock(&fs_mutex);
+
+    pthread_mutex_lock(&snapshot_mutex);
+    s->gen = ++snapshot_gen;
+    s->next = snapshots;
+    snapshots = s;
+    atomic_fetch_add_explicit(&num_snapshots, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&snapshot_mutex);
+    return s;
+}
+
+static snapshot *snapshot_take(void) {
+    pthread_rwlock_wrlock(&change_lock);
+    snapshot *s = snapshot_take_locked();
+    pthread_rwlock_unlock(&change_lock);
+    return s;
+}
+
+static void snapshot_object_put(snapshot_object *so) {
+    if (so == &snapshot_free_slot || atomic_fetch_sub_explicit(&so->refs, 1, memory_order_acq_rel) != 1) return;
+    free(so->obj.name);
+    if (so->obj.type == FS_REG) file_free_data(&so->obj);
+    dir_free(so->obj.dir);
+    free(so);
+}
+
+static void snapshot_release(snapshot *s) {
+    if (!s) return;
+    pthread_mutex_lock(&snapshot_mutex);
+    for (snapshot **p = &snapshots; *p; p = &(*p)->next) {
+        if (*p == s) {
+            *p = s->next;
+            break;
+        }
+    }
+    atomic_fetch_sub_explicit(&num_snapshots, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&snapshot_mutex);
+
+    for (int i = 0; i < num_inode_segments; i++) {
+        snapshot_object **segment = atomic_load_explicit(&s->saved[i], memory_order_acquire);
+        if (!segment) continue;
+        for (int j = 0; j < INODE_SEGMENT_SIZE; j++) {
+            if (segment[j]) snapshot_object_put(segment[j]);
+        }
+        free(segment);
+    }
+    free(s->saved);
+    free(s);
+}
+
+// A copy of a directory's listing, for reading only: it has no hash index.
+static fs_dir *dir_clone_listing(const fs_dir *dir) {
+    fs_dir *copy = pool_alloc(sizeof(fs_dir));
+    if (!copy) return NULL;
+    memset(copy, 0, sizeof(fs_dir));
+    atomic_init(&copy->table, dir_table_new(DIR_MIN_BUCKETS));
+    if (!atomic_load_explicit(&copy->table, memory_order_relaxed)) {
+        pool_free(copy);
+        return NULL;
+    }
+    for (int c = 0; c < dir->num_chunks; c++) {
+        const fs_dir_chunk *chunk = dir->chunks[c];
+        for (int i = 0; i < chunk->count; i++) {
+            const fs_dentry *old = chunk->entries[i];
+            size_t size = sizeof(fs_dentry) + strlen(old->name) + 1;
+            fs_dentry *dentry = pool_alloc(size);
+            if (!dentry || dir_listing_append(copy, dentry) != 0) {
+                pool_free(dentry);
+                dir_free(copy);
+                return NULL;
+            }
+            memcpy(dentry, old, size);
+            atomic_init(&dentry->next, NULL);
+            copy->num_entries++;
+        }
+    }
+    copy->next_cookie = dir->next_cookie;
+    return copy;
+}
+
+// Freeze the current state of obj. The caller holds its write lock.
+static snapshot_object *snapshot_freeze(const fs_object *obj) {
+    // An unlinked inode is already gone from the tree.
+    if (obj->type == FS_FREE || obj->unlinked) return &snapshot_free_slot;
+
+    snapshot_object *so = calloc(1, sizeof(snapshot_object));
+    if (!so) return NULL;
+    fs_object *copy = &so->obj;
+    copy->inode = obj->inode;
+    copy->type = obj->type;
+    copy->nlink = obj->nlink;
+    copy->size = obj->size;
+    copy->name = obj->name ? strdup(obj->name) : NULL;
+    if (obj->name && !copy->name) goto fail;
+
+    if (obj->type == FS_DIR) {
+        copy->dir = dir_clone_listing(obj->dir);
+        if (!copy->dir) goto fail;
+    } else if (obj->image_len) {
+        // Unchanged since the image was loaded: read it from there.
+        file_init_lazy(copy, obj->image_offset, obj->image_len, obj->size);
+    } else if (obj->data_inline) {
+        copy->data_inline = true;
+        memcpy(copy->inline_data, obj->inline_data, INLINE_DATA_SIZE);
+    } else {
+        size_t num_chunks = chunk_count(obj->size) < obj->max_chunks ? chunk_count(obj->size) : obj->max_chunks;
+        copy->chunks = num_chunks ? malloc(num_chunks * sizeof(char *)) : NULL;
+        if (num_chunks && !copy->chunks) goto fail;
+        for (size_t i = 0; i < num_chunks; i++) {
+            copy->chunks[i] = obj->chunks[i];
+            if (copy->chunks[i]) chunk_get(copy->chunks[i]);
+        }
+        copy->max_chunks = num_chunks;
+        copy->first_chunk_size = obj->first_chunk_size;
+        copy->mapped = obj->mapped;
+        copy->extents = obj->extents;
+        copy->num_extents = obj->num_extents;
+        copy->mapped_len = obj->mapped_len;
+        copy->mapped_stored = obj->mapped_stored;
+    }
+    return so;
+
+fail:
+    free(copy->name);
+    free(so);
+    return NULL;
+}
+
+// Called before changing the object in slot inode, with its write lock
+// held and inside change_begin: gives every snapshot taken since the
+// object was last changed its own copy of the current state.
+static void snapshot_preserve(fs_object *obj, int inode) {
+    if (obj->snap_gen == snapshot_gen) return;
+    if (atomic_load_explicit(&num_snapshots, memory_order_relaxed) == 0) {
+        obj->snap_gen = snapshot_gen;
+        return;
+    }
+
+    pthread_mutex_lock(&snapshot_mutex);
+    snapshot_object *so = NULL;
+    for (snapshot *s = snapshots; s; s = s->next) {
+        if (s->gen <= obj->snap_gen || inode >= s->num_objects) continue;
+
+        int index = inode >> INODE_SEGMENT_SHIFT;
+        snapshot_object **segment = atomic_load_explicit(&s->saved[index], memory_order_relaxed);
+        if (!segment) {
+            segment = calloc(INODE_SEGMENT_SIZE, sizeof(*segment));
+            if (!segment) {
+                s->failed = true;
+                continue;
+            }
+            atomic_store_explicit(&s->saved[index], segment, memory_order_release);
+        }
+        if (!so) so = snapshot_freeze(obj);
+        if (!so) {
+            s->failed = true;
+            continue;
+        }
+        if (so != &snapshot_free_slot) atomic_fetch_add_explicit(&so->refs, 1, memory_order_relaxed);
+        segment[inode & (INODE_SEGMENT_SIZE - 1)] = so;
+    }
+    obj->snap_gen = snapshot_gen;
+    pthread_mutex_unlock(&snapshot_mutex);
+}
+
+// The object in slot inode as of snapshot s. Returns either its frozen
+// copy or the live object with its read lock held, in which case *locked
+// is set; pass both to snapshot_view_done.
+static const fs_object *snapshot_view(snapshot *s, int inode, bool *locked) {
+    if (inode >= s->num_objects) {
+        *locked = false;
+        return &snapshot_free_slot.obj;
+    }
+    fs_object *obj = fs_obj(inode);
+    pthread_rwlock_rdlock(&obj->lock);
+    snapshot_object **segment = atomic_load_explicit(&s->saved[inode >> INODE_SEGMENT_SHIFT], memory_order_acquire);
+    snapshot_object *so = segment ? segment[inode & (INODE_SEGMENT_SIZE - 1)] : NULL;
+    if (so || obj->unlinked) {
+        pthread_rwlock_unlock(&obj->lock);
+        *locked = false;
+        return so ? &so->obj : &snapshot_free_slot.obj;
+    }
+    *locked = true;
+    return obj;
+}
+
+static void snapshot_view_done(const fs_object *obj, bool locked) {
+    if (locked) pthread_rwlock_unlock(&((fs_object *)obj)->lock);
+}
+
+// Make room for len more bytes in b.
+static int binary_image_reserve(image_buf *b, size_t len) {
+    if (b->len + len > b->cap) {
+        size_t new_cap = b->cap ? b->cap : 4096;
+        while (new_cap < b->len + len) new_cap *= 2;
+        char *new_data = realloc(b->data, new_cap);
+        if (!new_data) return -ENOMEM;
+        b->data = new_data;
+        b->cap = new_cap;
+    }
+    return 0;
+}
+
+static int binary_image_append(image_buf *b, const void *data, size_t len) {
+    int res = binary_image_reserve(b, len);
+    if (res != 0) return res;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static int binary_image_add_string(image_buf *strings, const char *s, uint64_t *offset) {
+    *offset = strings->len;
+    return binary_image_append(strings, s, strlen(s) + 1);
+}
+
+static int binary_image_pad(FILE *f, uint64_t offset) {
+    while ((uint64_t)ftello(f) < offset) {
+        if (fputc(0, f) == EOF) return -EIO;
+    }
+    return 0;
+}
+
+// The regions of an image under construction.
+typedef struct {
+    image_buf records, entries, extents, strings;
+    uint64_t data_size;
+} binary_image_parts;
+
+static void binary_image_parts_free(binary_image_parts *parts) {
+    free(parts->records.data);
+    free(parts->entries.data);
+    free(parts->extents.data);
+    free(parts->strings.data);
+}
+
+// Build the records of the count inodes listed in inodes (or of inodes 0
+// to count - 1 if it is NULL) as of snapshot s in memory. A full image
+// skips free inodes; a partial one records them. Only the file extents
+// are taken here; binary_image_write_data streams the data from the same
+// snapshot.
+static int binary_image_collect(snapshot *s, const int *inodes, int count, bool partial, binary_image_parts *parts) {
+    parts->data_size = 0;
+    for (int i = 0; i < count; i++) {
+        int inode = inodes ? inodes[i] : i;
+        binary_image_record rec = { .inode = inode, .type = FS_FREE, .name = BINARY_IMAGE_NO_NAME };
+        int res = 0;
+
+        bool locked;
+        const fs_object *obj = snapshot_view(s, inode, &locked);
+        if (obj->type == FS_FREE && !partial) {
+            snapshot_view_done(obj, locked);
+            continue;
+        }
+        if (obj->type != FS_FREE) {
+            rec.type = obj->type;
+            if (obj->name) res = binary_image_add_string(&parts->strings, obj->name, &rec.name);
+        }
+        if (obj->type == FS_REG) {
+            rec.size = obj->size;
+            rec.start = parts->extents.len / sizeof(file_extent);
+            size_t len;
+            for (size_t pos = file_next_data(obj, 0, &len); len > 0 && res == 0; pos = file_next_data(obj, pos + len, &len)) {
+                file_extent e = { .offset = pos, .len = len, .start = parts->data_size };
+                res = binary_image_append(&parts->extents, &e, sizeof(e));
+                parts->data_size += len;
+                rec.num_entries++;
+            }
+        } else if (obj->type == FS_DIR) {
+            rec.num_entries = obj->dir->num_entries;
+            rec.start = parts->entries.len / sizeof(binary_image_entry);
+            for (int c = 0; c < obj->dir->num_chunks && res == 0; c++) {
+                const fs_dir_chunk *chunk = obj->dir->chunks[c];
+                for (int j = 0; j < chunk->count && res == 0; j++) {
+                    binary_image_entry entry = { .inode = chunk->entries[j]->inode };
+                    res = binary_image_add_string(&parts->strings, chunk->entries[j]->name, &entry.name);
+                    if (res == 0) res = binary_image_append(&parts->entries, &entry, sizeof(entry));
+                }
+            }
+        }
+        snapshot_view_done(obj, locked);
+
+        if (res == 0) res = binary_image_append(&parts->records, &rec, sizeof(rec));
+        if (res != 0) return res;
+    }
+    return s->failed ? -ENOMEM : 0;
+}
+
+// Copy the extents of every regular file, in record order, from the
+// snapshot binary_image_collect read the records from.
+static int binary_image_write_data(FILE *f, const binary_image_parts *parts, snapshot *s) {
+    char *buf = malloc(CHUNK_SIZE);
+    if (!buf) return -ENOMEM;
+
+    int res = 0;
+    const binary_image_record *recs = (const binary_image_record *)parts->records.data;
+    const file_extent *extents = (const file_extent *)parts->extents.data;
+    size_t num_records = parts->records.len / sizeof(binary_image_record);
+    for (size_t i = 0; i < num_records && res == 0; i++) {
+        if (recs[i].type != FS_REG || recs[i].num_entries == 0) continue;
+
+        // Data that was never loaded is decoded straight from the JSON image,
+        // as a single extent.
+        bool locked;
+        const fs_object *obj = snapshot_view(s, recs[i].inode, &locked);
+        if (file_unloaded(obj)) {
+            image_buf data = { 0 };
+            res = file_fetch(obj, &data);
+            snapshot_view_done(obj, locked);
+            if (res == 0 && fwrite(data.data, 1, data.len, f) != data.len) res = -EIO;
+            free(data.data);
+            continue;
+        }
+        snapshot_view_done(obj, locked);
+
+        // A chunk at a time, so writers to the file aren't held up long.
+        for (uint32_t j = 0; j < recs[i].num_entries && res == 0; j++) {
+            const file_extent *e = &extents[recs[i].start + j];
+            for (uint64_t pos = e->offset; pos < e->offset + e->len && res == 0; pos += CHUNK_SIZE) {
+                size_t n = e->offset + e->len - pos < CHUNK_SIZE ? e->offset + e->len - pos : CHUNK_SIZE;
+                obj = snapshot_view(s, recs[i].inode, &locked);
+                file_read(obj, buf, n, pos);
+                snapshot_view_done(obj, locked);
+                if (fwrite(buf, 1, n, f) != n) res = -EIO;
+            }
+        }
+    }
+    free(buf);
+    return res;
+}
+
+// Create a temporary file next to filename, for writing a replacement.
+// Returns its descriptor and sets *tmp to its name, or returns -errno.
+static int create_temp_file(const char *filename, char **tmp) {
+    size_t path_len = strlen(filename) + sizeof(".XXXXXX");
+    *tmp = malloc(path_len);
+    if (!*tmp) return -ENOMEM;
+    snprintf(*tmp, path_len, "%s.XXXXXX", filename);
+    int fd = mkstemp(*tmp);
+    if (fd < 0) {
+        int res = -errno;
+        free(*tmp);
+        *tmp = NULL;
+        return res;
+    }
+    fchmod(fd, 0644);
+    return fd;
+}
+
+// Write the image collected from snapshot s to a temporary file next to
+// filename and sync it. If tmp_name is NULL the file is then renamed over filename, so the
+// image being replaced, which may be the one that is mounted, is never
+// modified in place; otherwise the caller gets its name and renames it.
+// Returns 0 or -errno.
+static int binary_image_write(const char *filename, uint32_t flags, const binary_image_parts *parts, snapshot *s, char **tmp_name) {
+    binary_image_header h = {
+        .magic = BINARY_IMAGE_MAGIC,
+        .version = BINARY_IMAGE_VERSION,
+        .flags = flags,
+        .num_records = parts->records.len / sizeof(binary_image_record),
+        .num_entries = parts->entries.len / sizeof(binary_image_entry),
+        .records_offset = sizeof(binary_image_header),
+    };
+    h.entries_offset = h.records_offset + parts->records.len;
+    h.extents_offset = h.entries_offset + parts->entries.len;
+    h.num_extents = parts->extents.len / sizeof(file_extent);
+    h.strings_offset = h.extents_offset + parts->extents.len;
+    h.strings_size = parts->strings.len;
+    h.data_offset = (h.strings_offset + h.strings_size + BINARY_IMAGE_DATA_ALIGN - 1) & ~(uint64_t)(BINARY_IMAGE_DATA_ALIGN - 1);
+    h.data_size = parts->data_size;
+
+    char *tmp;
+    int fd = create_temp_file(filename, &tmp);
+    if (fd < 0) return fd;
+    int res = 0;
+    FILE *f = fdopen(fd, "wb");
+    if (!f) {
+        res = -errno;
+        close(fd);
+    }
+    if (res == 0) {
+        if (fwrite(&h, sizeof(h), 1, f) != 1 ||
+            fwrite(parts->records.data, 1, parts->records.len, f) != parts->records.len ||
+            fwrite(parts->entries.data, 1, parts->entries.len, f) != parts->entries.len ||
+            fwrite(parts->extents.data, 1, parts->extents.len, f) != parts->extents.len ||
+            fwrite(parts->strings.data, 1, parts->strings.len, f) != parts->strings.len) {
+            res = -EIO;
+        }
+    }
+    if (res == 0) res = binary_image_pad(f, h.data_offset);
+    if (res == 0) res = binary_image_write_data(f, parts, s);
+    if (res == 0 && (fflush(f) != 0 || fsync(fileno(f)) != 0)) res = -EIO;
+    if (f && fclose(f) != 0 && res == 0) res = -EIO;
+    if (res == 0 && !tmp_name && rename(tmp, filename) != 0) res = -errno;
+
+    if (res != 0) {
+        unlink(tmp);
+        fprintf(stderr, "Failed to write binary image %s: %s\n", filename, strerror(-res));
+    }
+    if (res == 0 && tmp_name) {
+        *tmp_name = tmp;
+    } else {
+        free(tmp);
+    }
+    return res;
+}
+
+// Write the whole file system as of snapshot s as a binary image, as
+// binary_image_write does. Returns 0 or -errno.
+static int store_snapshot_binary(snapshot *s, const char *filename, char **tmp_name) {
+    binary_image_parts parts = { 0 };
+    int res = binary_image_collect(s, NULL, s->num_objects, false, &parts);
+    if (res == 0) res = binary_image_write(filename, 0, &parts, s, tmp_name);
+    binary_image_parts_free(&parts);
+    return res;
+}
+
+// Save the file system as a binary image, as it is at the time of the
+// call; it may go on changing while the file is written. Returns 0 or
+// -errno.
+static int store_binary_image(const char *filename) {
+    snapshot *s = snapshot_take();
+    if (!s) return -ENOMEM;
+    int res = store_snapshot_binary(s, filename, NULL);
+    snapshot_release(s);
+    return res;
+}
+
+// JSON images are written by several threads (-o save_threads=N, default
+// one per CPU). The inode table is cut into batches of JSON_SAVE_BATCH
+// slots; each thread takes the next batch and renders it into a buffer of
+// its own, and the calling thread writes the buffers out in inode order as
+// they become ready. The threads stay at most JSON_SAVE_WINDOW batches each
+// ahead of the writer, so only a few batches are held in memory at once.
+//
+// The output is compact. -o pretty_json writes the indented layout of
+// json-c's JSON_C_TO_STRING_PRETTY instead.
+#define JSON_SAVE_BATCH 256
+#define JSON_SAVE_WINDOW 4
+#define JSON_SAVE_BUFFER_SIZE (1 << 20)  // stdio buffer of the output file
+
+static int save_threads;  // 0: one per online CPU
+static bool json_pretty;
+
+typedef struct {
+    image_buf buf;
+    int res;     // first error while rendering
+    bool ready;  // rendered and not yet written out
+} json_save_batch;
+
+typedef struct {
+    snapshot *s;
+    int num_batches;
+    int window;  // batch b is rendered into ring[b % window]
+    json_save_batch *ring;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;  // a batch is ready or has been written out
+    int next;             // next batch to render
+    int written;          // batches written out so far
+    bool stop;            // the writer gave up
+} json_save;
+
+static void json_put(json_save_batch *b, const char *data, size_t len) {
+    if (b->res == 0) b->res = binary_image_append(&b->buf, data, len);
+}
+
+// Put the pretty or the compact form of a piece of layout.
+static void json_put_layout(json_save_batch *b, const char *pretty, const char *compact) {
+    const char *text = json_pretty ? pretty : compact;
+    json_put(b, text, strlen(text));
+}
+
+static void json_put_int(json_save_batch *b, int value) {
+    // Inode numbers are never negative.
+    char digits[12], *p = digits + sizeof(digits);
+    unsigned int v = value;
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    json_put(b, p, digits + sizeof(digits) - p);
+}
+
+// Put the contents of a string, escaped. Bytes from 0x80 up are copied as
+// they are, as json-c does, and the loader reads them back unchanged.
+static void json_put_escaped(json_save_batch *b, const char *data, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    while (len > 0 && b->res == 0) {
+        // A piece at a time, with room for every byte to become \u00XX.
+        size_t n = len < 4096 ? len : 4096;
+        b->res = binary_image_reserve(&b->buf, n * 6);
+        if (b->res != 0) break;
+        char *p = b->buf.data + b->buf.len;
+        for (size_t i = 0; i < n; i++) {
+            unsigned char c = data[i];
+            if (c >= 0x20 && c != '"' && c != '\\') {
+                *p++ = c;
+                continue;
+            }
+            *p++ = '\\';
+            switch (c) {
+            case '"': case '\\': *p++ = c; break;
+            case '\b': *p++ = 'b'; break;
+            case '\f': *p++ = 'f'; break;
+            case '\n': *p++ = 'n'; break;
+            case '\r': *p++ = 'r'; break;
+            case '\t': *p++ = 't'; break;
+            default:
+                memcpy(p, "u00", 3);
+                p[3] = hex[c >> 4];
+                p[4] = hex[c & 0xf];
+                p += 5;
+            }
+        }
+        b->buf.len = p - b->buf.data;
+        data += n;
+        len -= n;
+    }
+}
+
+static void json_put_string(json_save_batch *b, const char *s) {
+    json_put(b, "\"", 1);
+    json_put_escaped(b, s, strlen(s));
+    json_put(b, "\"", 1);
+}
+
+// Put the data of the regular file in slot inode as of snapshot s.
+static void json_put_file_data(json_save_batch *b, snapshot *s, int inode) {
+    bool locked;
+    const fs_object *obj = snapshot_view(s, inode, &locked);
+    off_t size = obj->size;
+    json_put(b, "\"", 1);
+    if (file_unloaded(obj)) {
+        // Data that was never loaded is decoded straight from the JSON image.
+        image_buf data = { 0 };
+        int res = file_fetch(obj, &data);
+        snapshot_view_done(obj, locked);
+        if (res == 0) {
+            json_put_escaped(b, data.data, data.len);
+        } else if (b->res == 0) {
+            b->res = res;
+        }
+        free(data.data);
+    } else {
+        snapshot_view_done(obj, locked);
+
+        // A chunk at a time, so writers to the file aren't held up long.
+        char chunk[CHUNK_SIZE];
+        for (off_t pos = 0; pos < size && b->res == 0; pos += CHUNK_SIZE) {
+            size_t n = size - pos < (off_t)CHUNK_SIZE ? (size_t)(size - pos) : CHUNK_SIZE;
+            obj = snapshot_view(s, inode, &locked);
+            file_read(obj, chunk, n, pos);
+            snapshot_view_done(obj, locked);
+            json_put_escaped(b, chunk, n);
+        }
+    }
+    json_put(b, "\"", 1);
+}
+
+// Render the objects in batch number batch as of snapshot s into b. Each
+// object is preceded by a comma; the writer drops the very first one.
+static void json_save_render(json_save_batch *b, snapshot *s, int batch) {
+    int first = batch * JSON_SAVE_BATCH;
+    int last = first + JSON_SAVE_BATCH < s->num_objects ? first + JSON_SAVE_BATCH : s->num_objects;
+    b->buf.len = 0;
+    b->res = 0;
+    for (int i = first; i < last && b->res == 0; i++) {
+        bool locked;
+        const fs_object *obj = snapshot_view(s, i, &locked);
+        fs_type type = obj->type;
+        if (type == FS_FREE) {
+            snapshot_view_done(obj, locked);
+            continue;
+        }
+
+        json_put_layout(b, ",\n  {\n    \"inode\":", ",{\"inode\":");
+        json_put_int(b, i);
+        json_put_layout(b, ",\n    \"type\":", ",\"type\":");
+        json_put_string(b, fs_type_name(type));
+        if (obj->name) {
+            json_put_layout(b, ",\n    \"name\":", ",\"name\":");
+            json_put_string(b, obj->name);
+        }
+        if (type == FS_DIR) {
+            json_put_layout(b, ",\n    \"entries\":[\n", ",\"entries\":[");
+            int n = 0;
+            for (int c = 0; c < obj->dir->num_chunks; c++) {
+                const fs_dir_chunk *chunk = obj->dir->chunks[c];
+                for (int j = 0; j < chunk->count; j++) {
+                    if (n++ > 0) json_put_layout(b, ",\n", ",");
+                    json_put_layout(b, "      {\n        \"name\":", "{\"name\":");
+                    json_put_string(b, chunk->entries[j]->name);
+                    json_put_layout(b, ",\n        \"inode\":", ",\"inode\":");
+                    json_put_int(b, chunk->entries[j]->inode);
+                    json_put_layout(b, "\n      }", "}");
+                }
+            }
+            json_put_layout(b, n > 0 ? "\n    ]" : "    ]", "]");
+        }
+        snapshot_view_done(obj, locked);
+
+        if (type == FS_REG) {
+            json_put_layout(b, ",\n    \"data\":", ",\"data\":");
+            json_put_file_data(b, s, i);
+        }
+        json_put_layout(b, "\n  }", "}");
+    }
+}
+
+static void *json_save_main(void *arg) {
+    json_save *js = arg;
+    pthread_mutex_lock(&js->mutex);
+    for (;;) {
+        while (!js->stop && js->next < js->num_batches && js->next >= js->written + js->window) {
+            pthread_cond_wait(&js->cond, &js->mutex);
+        }
+        if (js->stop || js->next >= js->num_batches) break;
+        int batch = js->next++;
+        pthread_mutex_unlock(&js->mutex);
+
+        json_save_batch *b = &js->ring[batch % js->window];
+        json_save_render(b, js->s, batch);
+
+        pthread_mutex_lock(&js->mutex);
+        b->ready = true;
+        pthread_cond_broadcast(&js->cond);
+    }
+    pthread_mutex_unlock(&js->mutex);
+    return NULL;
+}
+
+// Write the objects of snapshot s to f, rendered in parallel. Returns 0 or
+// -errno.
+static int json_save_write(FILE *f, snapshot *s) {
+    json_save js = { .s = s, .num_batches = (s->num_objects + JSON_SAVE_BATCH - 1) / JSON_SAVE_BATCH };
+    int num_threads = save_threads > 0 ? save_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads > js.num_batches) num_threads = js.num_batches;
+    if (num_threads < 1) num_threads = 1;
+    js.window = num_threads * JSON_SAVE_WINDOW;
+    js.ring = calloc(js.window, sizeof(json_save_batch));
+    pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+    if (!js.ring || !threads) {
+        free(js.ring);
+        free(threads);
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&js.mutex, NULL);
+    pthread_cond_init(&js.cond, NULL);
+    int started = 0;
+    while (started < num_threads && pthread_create(&threads[started], NULL, json_save_main, &js) == 0) {
+        started++;
+    }
+
+    int res = 0;
+    bool first = true;
+    for (int batch = 0; batch < js.num_batches && res == 0; batch++) {
+        json_save_batch *b = &js.ring[batch % js.window];
+        if (started == 0) {
+            json_save_render(b, s, batch);  // no threads: render it here
+        } else {
+            pthread_mutex_lock(&js.mutex);
+            while (!b->ready) pthread_cond_wait(&js.cond, &js.mutex);
+            pthread_mutex_unlock(&js.mutex);
+        }
+
+        res = b->res;
+        size_t skip = first && b->buf.len > 0;  // the first object's comma
+        if (res == 0 && b->buf.len > 0) {
+            if (fwrite(b->buf.data + skip, 1, b->buf.len - skip, f) != b->buf.len - skip) res = -EIO;
+            first = false;
+        }
+        if (b->buf.cap > JSON_SAVE_BUFFER_SIZE) {
+            // It held a large file; don't keep that much around.
+            free(b->buf.data);
+            b->buf = (image_buf){ 0 };
+        }
+
+        pthread_mutex_lock(&js.mutex);
+        b->ready = false;
+        js.written++;
+        pthread_cond_broadcast(&js.cond);
+        pthread_mutex_unlock(&js.mutex);
+    }
+
+    pthread_mutex_lock(&js.mutex);
+    js.stop = true;
+    pthread_cond_broadcast(&js.cond);
+    pthread_mutex_unlock(&js.mutex);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < js.window; i++) {
+        free(js.ring[i].buf.data);
+    }
+    pthread_cond_destroy(&js.cond);
+    pthread_mutex_destroy(&js.mutex);
+    free(js.ring);
+    free(threads);
+    return res == 0 && s->failed ? -ENOMEM : res;
+}
+
+// Write the file system as of snapshot s as JSON, the way
+// binary_image_write writes a binary image: to a temporary file next to
+// json_file that is synced, then renamed over json_file or, if tmp_name
+// is not NULL, handed to the caller. Returns 0 or -errno.
+static int store_snapshot_json(snapshot *s, const char *json_file, char **tmp_name) {
+    char *tmp;
+    int fd = create_temp_file(json_file, &tmp);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to write JSON file %s: %s\n", json_file, strerror(-fd));
+        return fd;
+    }
+    int res = 0;
+    char *buffer = malloc(JSON_SAVE_BUFFER_SIZE);
+    FILE *f = buffer ? fdopen(fd, "wb") : NULL;
+    if (!f) {
+        res = buffer ? -errno : -ENOMEM;
+        close(fd);
+    }
+    if (res == 0) setvbuf(f, buffer, _IOFBF, JSON_SAVE_BUFFER_SIZE);
+    if (res == 0 && fputs("[", f) == EOF) res = -EIO;
+    if (res == 0) res = json_save_write(f, s);
+    if (res == 0 && fputs(json_pretty ? "\n]" : "]", f) == EOF) res = -EIO;
+    if (res == 0 && (fflush(f) != 0 || fsync(fileno(f)) != 0)) res = -EIO;
+    if (f && fclose(f) != 0 && res == 0) res = -EIO;
+    free(buffer);
+    if (res == 0 && !tmp_name && rename(tmp, json_file) != 0) res = -errno;
+
+    if (res != 0) {
+        unlink(tmp);
+        fprintf(stderr, "Failed to write JSON file %s: %s\n", json_file, strerror(-res));
+    }
+    if (res == 0 && tmp_name) {
+        *tmp_name = tmp;
+    } else {
+        free(tmp);
+    }
+    return res;
+}
+
+// Save the file system as JSON, as it is at the time of the call; it may
+// go on changing while the file is written. The file is replaced in one
+// step, so it is never seen half written. Prints the throughput.
+int store_file_system(char *json_file) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    snapshot *s = snapshot_take();
+    if (!s) {
+        fprintf(stderr, "Failed to write JSON file %s: %s\n", json_file, strerror(ENOMEM));
+        return -1;
+    }
+    int res = store_snapshot_json(s, json_file, NULL);
+    snapshot_release(s);
+    if (res != 0) return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    struct stat st;
+    if (stat(json_file, &st) == 0) {
+        fprintf(stderr, "saved %s: %.1f MB in %.3f s, %.0f MB/s\n", json_file, st.st_size / 1e6, elapsed, st.st_size / 1e6 / elapsed);
+    }
+    return 0;
+}
+
+// Write-ahead journal. Every change is appended to the journal before the
+// operation returns, so changes survive a crash without rewriting the
+// image: at mount the journal is replayed on top of the image it was
+// started on. Records name inodes by number, and create and mkdir record
+// the number they got, so replay rebuilds exactly the same table. Each
+// record is appended while the inodes it touches are locked, so records of
+// conflicting operations are in the order they were applied. A change is
+// durable once an fsync or flush (close) has returned after it.
+//
+//   journal header | record | record | ...
+//
+// A record is a journal_record_header followed by a journal_op and then
+// the written bytes (write) or a NUL-terminated name (create, mkdir,
+// unlink, rmdir). A torn or corrupt record at the end, left by a crash in
+// the middle of an append, is cut off at replay.
+//
+// Checkpoints (see checkpoint_run) move the replay start forward: the
+// header counts the checkpoint segments to apply on top of the image
+// before replaying, and where in the file replay starts.
+#define JOURNAL_MAGIC "JSONFSJ2"
+
+typedef enum {
+    JOURNAL_CREATE = 1,
+    JOURNAL_MKDIR,
+    JOURNAL_WRITE,
+    JOURNAL_TRUNCATE,
+    JOURNAL_UNLINK,
+    JOURNAL_RMDIR,
+} journal_op_type;
+
+// Identifies the image a journal applies to, and the checkpoints taken
+// since it was started.
+typedef struct {
+    char magic[8];
+    uint64_t image_size;
+    int64_t image_mtime_sec;
+    int64_t image_mtime_nsec;
+    uint64_t checkpoint;   // segments <image>.seg1 to .segN are applied first
+    uint64_t replay_from;  // file offset of the first record to replay
+} journal_file_header;
+
+// The part of the header that identifies the image.
+#define JOURNAL_IDENTITY_SIZE offsetof(journal_file_header, checkpoint)
+
+typedef struct {
+    uint32_t size;      // bytes that follow
+    uint32_t checksum;  // FNV-1a of those bytes
+} journal_record_header;
+
+typedef struct {
+    uint32_t type;    // journal_op_type
+    int32_t inode;
+    int32_t parent;   // create, mkdir, unlink, rmdir
+    uint32_t pad;
+    uint64_t offset;  // write: file offset; truncate: new size
+} journal_op;
+
+// Records are appended to an in-memory buffer and reach the file in
+// batches. fsync and flush commit with group commit: the first caller to
+// find no commit in progress becomes the leader. While syncs are arriving
+// concurrently, it holds the batch open for up to commit_delay, or until
+// as many callers have joined as in the previous batch; a lone caller
+// never waits. It then writes the whole
+// buffer with one write() and one fdatasync(). Every caller whose records
+// were in that buffer returns when it completes; callers that arrive
+// during a commit form the next batch. Only one commit runs at a time,
+// which keeps batches in order in the file. Appenders write the buffer
+// out themselves (without syncing) when it grows past JOURNAL_BUFFER_SIZE.
+#define JOURNAL_BUFFER_SIZE ((size_t)1 << 20)
+#define DEFAULT_COMMIT_DELAY_US 1000
+
+static int journal_fd = -1;
+static int commit_delay_us = DEFAULT_COMMIT_DELAY_US;
+static char *journal_path, *journal_image_path;
+static journal_file_header journal_header;  // as last written
+
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t journal_join_cond = PTHREAD_COND_INITIALIZER;  // a caller joined the open batch
+static struct {
+    image_buf buf, spare;     // records not written yet; buffer to swap in
+    uint64_t appended;        // bytes of records appended, written or not
+    uint64_t synced;          // bytes known to be on disk
+    int64_t start;            // file offset of appended byte 0
+    bool committing;          // a write-out is in progress
+    bool failed;              // records were lost; see journal_sync
+    bool recovering;          // a compaction is replacing a failed journal
+    int waiting;              // fsync callers waiting for a commit
+    int last_batch;           // callers served by the previous commit
+    // Metrics, printed at unmount.
+    unsigned long commits, batched_callers, max_batch;
+    double latency_total, latency_max;  // seconds, per fsync caller
+} journal;
+
+static double journal_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t journal_checksum(uint32_t hash, const void *data, size_t len) {
+    // FNV-1a, continued from hash
+    for (const unsigned char *p = data; len > 0; p++, len--) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Write out everything appended so far, and sync it if sync is set. Called
+// with journal_mutex held and no commit in progress; drops the mutex while
+// doing I/O, with committing set so that nobody else starts one.
+static void journal_write_out(bool sync) {
+    journal.committing = true;
+    image_buf out = journal.buf;
+    journal.buf = journal.spare;
+    journal.buf.len = 0;
+    uint64_t end = journal.appended;
+    pthread_mutex_unlock(&journal_mutex);
+
+    bool ok = true;
+    for (size_t done = 0; done < out.len && ok; ) {
+        ssize_t n = write(journal_fd, out.data + done, out.len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) ok = false;
+        else done += n;
+    }
+    if (ok && sync && fdatasync(journal_fd) != 0) ok = false;
+    if (!ok) fprintf(stderr, "Failed to write the journal: %s\n", strerror(errno));
+
+    pthread_mutex_lock(&journal_mutex);
+    journal.spare = out;
+    if (!ok) journal.failed = true;
+    // On failure too, so waiters wake up and report it.
+    if (sync || !ok) journal.synced = end;
+    journal.committing = false;
+    pthread_cond_broadcast(&journal_cond);
+}
+
+// Inodes changed since the last checkpoint, one bit each. Every journaled
+// operation marks the inodes its record names.
+static _Atomic uint64_t *dirty_map;
+
+static void mark_dirty(int inode) {
+    if (!dirty_map || inode < 0) return;
+    atomic_fetch_or_explicit(&dirty_map[inode / 64], (uint64_t)1 << (inode % 64), memory_order_relaxed);
+}
+
+// Append one record. Failures are remembered and reported by fsync (see
+// journal_sync): the change itself has already been made in memory.
+static void journal_append(journal_op_type type, int inode, int parent, uint64_t offset, const void *tail, size_t tail_len) {
+    if (journal_fd < 0) return;
+    mark_dirty(inode);
+    mark_dirty(parent);
+
+    journal_op op = { .type = type, .inode = inode, .parent = parent, .offset = offset };
+    journal_record_header header = {
+        .size = sizeof(op) + tail_len,
+        .checksum = journal_checksum(journal_checksum(2166136261u, &op, sizeof(op)), tail, tail_len),
+    };
+
+    pthread_mutex_lock(&journal_mutex);
+    image_buf *b = &journal.buf;
+    size_t total = sizeof(header) + sizeof(op) + tail_len;
+    if (tail_len > UINT32_MAX - sizeof(op) || b->len + total < b->len) {
+        journal.failed = true;
+    } else {
+        if (b->len + total > b->cap) {
+            size_t new_cap = b->cap ? b->cap : 64 * 1024;
+            while (new_cap < b->len + total) new_cap *= 2;
+            char *new_data = realloc(b->data, new_cap);
+            if (new_data) {
+                b->data = new_data;
+                b->cap = new_cap;
+            }
+        }
+        if (b->len + total > b->cap) {
+            fprintf(stderr, "Failed to append to the journal: out of memory\n");
+            journal.failed = true;
+        } else {
+            memcpy(b->data + b->len, &header, sizeof(header));
+            memcpy(b->data + b->len + sizeof(header), &op, sizeof(op));
+            if (tail_len) memcpy(b->data + b->len + sizeof(header) + sizeof(op), tail, tail_len);
+            b->len += total;
+            journal.appended += total;
+        }
+    }
+    if (journal.buf.len >= JOURNAL_BUFFER_SIZE && !journal.committing) journal_write_out(false);
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+static void journal_append_name(journal_op_type type, int inode, int parent, const char *name) {
+    journal_append(type, inode, parent, 0, name, strlen(name) + 1);
+}
+
+// Write out and sync every record appended so far. Returns -EIO if records
+// have been lost since the journal was started.
+static int journal_commit(void) {
+    if (journal_fd < 0) return 0;
+    double start = journal_now();
+
+    pthread_mutex_lock(&journal_mutex);
+    uint64_t target = journal.appended;
+    journal.waiting++;
+    pthread_cond_signal(&journal_join_cond);
+    while (journal.synced < target) {
+        if (journal.committing) {
+            pthread_cond_wait(&journal_cond, &journal_mutex);
+            continue;
+        }
+
+        // Lead the next commit. Hold the window open for more callers if
+        // others are syncing too.
+        journal.committing = true;
+        if (commit_delay_us > 0 && (journal.waiting > 1 || journal.last_batch > 1)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (long)commit_delay_us * 1000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            while (journal.waiting < journal.last_batch &&
+                   pthread_cond_timedwait(&journal_join_cond, &journal_mutex, &deadline) == 0) {
+            }
+        }
+        int batch = journal.waiting;
+        journal.commits++;
+        journal.batched_callers += batch;
+        if ((unsigned long)batch > journal.max_batch) journal.max_batch = batch;
+        journal.last_batch = batch;
+        journal_write_out(true);
+    }
+    journal.waiting--;
+    int res = journal.failed ? -EIO : 0;
+
+    double latency = journal_now() - start;
+    journal.latency_total += latency;
+    if (latency > journal.latency_max) journal.latency_max = latency;
+    pthread_mutex_unlock(&journal_mutex);
+    return res;
+}
+
+// Make every record appended so far durable. Once a journal write or
+// append has failed, the journal is missing records, so every fsync
+// returns -EIO until the checkpoint thread has written a full image and
+// started a new journal for it (checkpoint_compact). After that, fsync
+// succeeds again. Without checkpoints, the errors last until unmount.
+static int journal_sync(void) {
+    int res = journal_commit();
+    if (res == 0 && journal_fd >= 0) {
+        pthread_mutex_lock(&journal_mutex);
+        if (journal.recovering) res = -EIO;
+        pthread_mutex_unlock(&journal_mutex);
+    }
+    return res;
+}
+
+static bool journal_failed(void) {
+    pthread_mutex_lock(&journal_mutex);
+    bool failed = journal.failed;
+    pthread_mutex_unlock(&journal_mutex);
+    return failed;
+}
+
+static void journal_print_stats(void) {
+    if (journal_fd < 0) return;
+    pthread_mutex_lock(&journal_mutex);
+    unsigned long callers = journal.batched_callers;
+    fprintf(stderr, "journal: %lu commits, %.1f callers per commit (max %lu), commit latency avg %.3f ms, max %.3f ms\n",
+            journal.commits, journal.commits ? (double)callers / journal.commits : 0.0, journal.max_batch,
+            callers ? journal.latency_total / callers * 1000 : 0.0, journal.latency_max * 1000);
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+static fs_object *journal_dir(int inode) {
+    if (inode < 0 || inode >= num_fs_objects || fs_obj(inode)->type != FS_DIR) return NULL;
+    return fs_obj(inode);
+}
+
+static fs_object *journal_file(int inode) {
+    if (inode < 0 || inode >= num_fs_objects || fs_obj(inode)->type != FS_REG) return NULL;
+    return fs_obj(inode);
+}
+
+// Apply one record at mount. Nothing else is running yet, so no locks are
+// taken. Returns 0, or -EINVAL if the record doesn't fit the file system.
+static int journal_apply(const journal_op *op, const char *tail, size_t tail_len) {
+    bool named = op->type == JOURNAL_CREATE || op->type == JOURNAL_MKDIR ||
+                 op->type == JOURNAL_UNLINK || op->type == JOURNAL_RMDIR;
+    if (named && (tail_len == 0 || tail[tail_len - 1] != '\0')) return -EINVAL;
+
+    switch (op->type) {
+    case JOURNAL_CREATE:
+    case JOURNAL_MKDIR: {
+        fs_object *parent_obj = journal_dir(op->parent);
+        if (!parent_obj || op->inode < 0 || op->inode >= max_inodes) return -EINVAL;
+        if (dir_lookup(parent_obj->dir, tail) >= 0) return -EINVAL;
+        if (inode_segment_alloc(op->inode) != 0) return -ENOMEM;
+
+        fs_object *obj = fs_obj(op->inode);
+        if (obj->type != FS_FREE) return -EINVAL;
+        obj->inode = op->inode;
+        obj->size = 0;
+        obj->name = NULL;
+        if (op->type == JOURNAL_CREATE) {
+            obj->type = FS_REG;
+            file_init_data(obj);
+        } else {
+            obj->type = FS_DIR;
+            __atomic_store_n(&obj->dir, dir_new(), __ATOMIC_RELEASE);
+            if (!obj->dir) return -ENOMEM;
+        }
+        int res = dir_add(parent_obj, tail, op->inode);
+        if (res != 0) return res;
+        obj->nlink = 1;
+        inode_map_take(op->inode);
+        if (op->inode >= num_fs_objects) num_fs_objects = op->inode + 1;
+        return 0;
+    }
+    case JOURNAL_WRITE:
+    case JOURNAL_TRUNCATE: {
+        fs_object *obj = journal_file(op->inode);
+        if (!obj) return -EINVAL;
+        int res = op->type == JOURNAL_TRUNCATE && op->offset == 0 ? 0 : file_load(obj);
+        if (res != 0) return res;
+        file_detach_image(obj);
+        return op->type == JOURNAL_WRITE ? file_write(obj, tail, tail_len, op->offset) : file_resize(obj, op->offset);
+    }
+    case JOURNAL_UNLINK:
+    case JOURNAL_RMDIR: {
+        fs_object *parent_obj = journal_dir(op->parent);
+        if (!parent_obj || dir_lookup(parent_obj->dir, tail) != op->inode) return -EINVAL;
+        fs_object *obj = fs_obj(op->inode);
+        if (obj->type == FS_DIR && obj->dir->num_entries > 0) return -EINVAL;
+        dir_remove(parent_obj, tail);
+        if (--obj->nlink == 0) {
+            free_fs_object(obj);
+            inode_map_put(op->inode);
+        }
+        return 0;
+    }
+    default:
+        return -EINVAL;
+    }
+}
+
+static char *path_with_suffix(const char *path, const char *fmt, uint64_t n) {
+    size_t len = strlen(path) + strlen(fmt) + 24;
+    char *out = malloc(len);
+    if (!out) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    int prefix = snprintf(out, len, "%s", path);
+    snprintf(out + prefix, len - prefix, fmt, (unsigned long long)n);
+    return out;
+}
+
+// path relative to the current directory made absolute, or NULL if out of
+// memory. Files that background threads create after libfuse has
+// daemonized (and changed to "/") are named this way.
+static char *absolute_path(const char *path) {
+    if (path[0] == '/') return strdup(path);
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd) return NULL;
+    char *out = malloc(strlen(cwd) + strlen(path) + 2);
+    if (out) sprintf(out, "%s/%s", cwd, path);
+    free(cwd);
+    return out;
+}
+
+// Checkpoint segment n of the image the journal belongs to.
+static char *segment_path(uint64_t n) {
+    return path_with_suffix(journal_image_path, ".seg%llu", n);
+}
+
+// The replacement journal written by a compaction.
+static char *journal_new_path(void) {
+    return path_with_suffix(journal_path, ".new", 0);
+}
+
+// Sync the directory holding path, so that a rename into it is durable.
+static int sync_parent_dir(const char *path) {
+    char *copy = strdup(path);
+    if (!copy) return -ENOMEM;
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+    free(copy);
+    if (fd < 0) return -errno;
+    int res = fsync(fd) == 0 ? 0 : -errno;
+    close(fd);
+    return res;
+}
+
+// Open the journal for the image at image_path, which has just been
+// loaded, apply the checkpoint segments it names, replay it and leave it
+// ready for appends. A new journal is created if there is none. Exits if
+// the journal belongs to another image or a record in it doesn't apply.
+static void journal_open(const char *path, const char *image_path) {
+    // The checkpoint thread creates segments and compacted images next to
+    // these after libfuse has daemonized.
+    journal_path = absolute_path(path);
+    journal_image_path = absolute_path(image_path);
+    struct stat image_st;
+    if (!journal_path || !journal_image_path || stat(image_path, &image_st) != 0) {
+        fprintf(stderr, "%s: %s\n", image_path, strerror(errno));
+        exit(1);
+    }
+    journal_file_header expected = {
+        .magic = JOURNAL_MAGIC,
+        .image_size = image_st.st_size,
+        .image_mtime_sec = image_st.st_mtim.tv_sec,
+        .image_mtime_nsec = image_st.st_mtim.tv_nsec,
+        .checkpoint = 0,
+        .replay_from = sizeof(journal_file_header),
+    };
+
+    // A compaction that stopped after replacing the image but before
+    // replacing the journal left the new journal next to the old one.
+    char *new_path = journal_new_path();
+    int new_fd = open(new_path, O_RDONLY);
+    if (new_fd >= 0) {
+        journal_file_header header;
+        bool current = pread(new_fd, &header, sizeof(header), 0) == sizeof(header) &&
+                       memcmp(&header, &expected, JOURNAL_IDENTITY_SIZE) == 0;
+        close(new_fd);
+        if ((current ? rename(new_path, path) : unlink(new_path)) != 0) {
+            fprintf(stderr, "%s: %s\n", new_path, strerror(errno));
+            exit(1);
+        }
+    }
+    free(new_path);
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to open journal %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    if (st.st_size == 0) {
+        if (write(fd, &expected, sizeof(expected)) != sizeof(expected) || fsync(fd) != 0) {
+            fprintf(stderr, "Failed to create journal %s\n", path);
+            exit(1);
+        }
+        st.st_size = sizeof(expected);
+    }
+
+    journal_file_header header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s: not a journal\n", path);
+        exit(1);
+    }
+    if (memcmp(&header, &expected, JOURNAL_IDENTITY_SIZE) != 0) {
+        fprintf(stderr, "%s: journal was started on a different version of %s; restore that image or remove the journal\n", path, image_path);
+        exit(1);
+    }
+    if (header.replay_from < sizeof(header) || header.replay_from > (uint64_t)st.st_size) {
+        fprintf(stderr, "%s: corrupt header\n", path);
+        exit(1);
+    }
+
+    pthread_mutex_lock(&fs_mutex);
+
+    // The segments up to the checkpoint count, in order, then the records
+    // after them.
+    if (header.checkpoint > 0) {
+        char *seg = NULL;
+        for (uint64_t n = 1; n <= header.checkpoint; n++) {
+            free(seg);
+            seg = segment_path(n);
+            binary_image_apply(binary_image_map(seg, true), seg);
+        }
+        load_count_links();
+        load_finish(seg);
+        free(seg);
+    }
+    // Any later ones were written by a checkpoint that didn't finish.
+    for (uint64_t n = header.checkpoint + 1; ; n++) {
+        char *seg = segment_path(n);
+        int res = unlink(seg);
+        free(seg);
+        if (res != 0) break;
+    }
+
+    dirty_map = calloc((max_inodes + 63) / 64, sizeof(*dirty_map));
+    if (!dirty_map) {
+        fprintf(stderr, "Failed to allocate the dirty inode map\n");
+        exit(1);
+    }
+
+    // Replay up to the first record that is incomplete or fails its
+    // checksum. Replayed inodes are dirty: the next checkpoint moves the
+    // replay start past their records.
+    off_t pos = header.replay_from;
+    long num_records = 0;
+    char *buf = NULL;
+    size_t buf_size = 0;
+    for (;;) {
+        journal_record_header rh;
+        if (st.st_size - pos < (off_t)sizeof(rh) || pread(fd, &rh, sizeof(rh), pos) != sizeof(rh)) break;
+        if (rh.size < sizeof(journal_op) || rh.size > st.st_size - pos - sizeof(rh)) break;
+        if (rh.size > buf_size) {
+            char *new_buf = realloc(buf, rh.size);
+            if (!new_buf) {
+                fprintf(stderr, "%s: out of memory\n", path);
+                exit(1);
+            }
+            buf = new_buf;
+            buf_size = rh.size;
+        }
+        if (pread(fd, buf, rh.size, pos + sizeof(rh)) != (ssize_t)rh.size) break;
+        if (journal_checksum(2166136261u, buf, rh.size) != rh.checksum) break;
+
+        journal_op op;
+        memcpy(&op, buf, sizeof(op));
+        int res = journal_apply(&op, buf + sizeof(op), rh.size - sizeof(op));
+        if (res != 0) {
+            fprintf(stderr, "%s: record %ld at byte %ld doesn't apply: %s\n", path, num_records, (long)pos, strerror(-res));
+            exit(1);
+        }
+        mark_dirty(op.inode);
+        mark_dirty(op.parent);
+        pos += sizeof(rh) + rh.size;
+        num_records++;
+    }
+    pthread_mutex_unlock(&fs_mutex);
+    free(buf);
+
+    if (pos < st.st_size) {
+        fprintf(stderr, "%s: dropping %ld bytes of incomplete records at the end\n", path, (long)(st.st_size - pos));
+        if (ftruncate(fd, pos) != 0 || fsync(fd) != 0) {
+            fprintf(stderr, "Failed to truncate journal %s: %s\n", path, strerror(errno));
+            exit(1);
+        }
+    }
+    if (lseek(fd, pos, SEEK_SET) < 0) {
+        fprintf(stderr, "Failed to open journal %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    journal_header = header;
+    journal.start = pos;
+    journal_fd = fd;
+}
+
+// Checkpoints. Without them the journal only grows, and mounting replays
+// everything written since the image was saved. A background thread
+// periodically writes the inodes changed since the last checkpoint as a
+// partial binary image, segment <image>.segN, and moves the journal's
+// replay start past the records it covers, so its cost follows the rate
+// of change and not the size of the file system. Once compact_segments
+// segments have piled up, a compaction merges them: it writes a fresh
+// image in the image's own format and starts a new journal for it.
+//
+// A segment must hold exactly the state at its cut in the journal, so the
+// dirty inodes are taken, a snapshot is taken and the cut is recorded in
+// one pause of change_lock; the segment is written from the snapshot
+// after writers have resumed. A compaction works the same way, and only
+// pauses writers again at the end, while it moves the journal records
+// written since its snapshot into the new journal.
+#define DEFAULT_CHECKPOINT_INTERVAL 30  // seconds
+#define DEFAULT_COMPACT_SEGMENTS 8
+
+static int checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;  // 0: no checkpoints
+static int compact_segments = DEFAULT_COMPACT_SEGMENTS;        // 0: never compact
+static bool checkpoints_on;
+
+static pthread_t checkpoint_thread;
+static bool checkpoint_thread_started, checkpoint_stopping;
+static pthread_mutex_t checkpoint_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t checkpoint_cond = PTHREAD_COND_INITIALIZER;
+
+// Metrics, printed at unmount.
+static struct {
+    unsigned long checkpoints, compactions, inodes;
+    uint64_t bytes;
+    double pause_max, time_total, time_max;  // seconds
+} checkpoint_stats;
+
+// Turn checkpoints on once the journal is open, unless the interval is 0.
+static void checkpoint_init(void) {
+    checkpoints_on = journal_fd >= 0 && checkpoint_interval > 0;
+}
+
+static void checkpoint_note_pause(double start) {
+    double pause = journal_now() - start;
+    if (pause > checkpoint_stats.pause_max) checkpoint_stats.pause_max = pause;
+}
+
+// Take the dirty inodes, clearing their bits. Returns how many there are,
+// with their numbers in *inodes, or -ENOMEM with every bit still set.
+static int checkpoint_take_dirty(int **inodes) {
+    int count = 0, cap = 0;
+    *inodes = NULL;
+    for (int w = 0; w < (max_inodes + 63) / 64; w++) {
+        uint64_t bits = atomic_exchange_explicit(&dirty_map[w], 0, memory_order_relaxed);
+        for (; bits; bits &= bits - 1) {
+            if (count == cap) {
+                cap = cap ? cap * 2 : 1024;
+                int *new_inodes = realloc(*inodes, cap * sizeof(int));
+                if (!new_inodes) {
+                    // Put back what was taken: the rest of this word and
+                    // the inodes collected so far.
+                    atomic_fetch_or_explicit(&dirty_map[w], bits, memory_order_relaxed);
+                    for (int i = 0; i < count; i++) mark_dirty((*inodes)[i]);
+                    free(*inodes);
+                    *inodes = NULL;
+                    return -ENOMEM;
+                }
+                *inodes = new_inodes;
+            }
+            (*inodes)[count++] = w * 64 + __builtin_ctzll(bits);
+        }
+    }
+    return count;
+}
+
+static int journal_write_header(int fd, const journal_file_header *header) {
+    if (pwrite(fd, header, sizeof(*header), 0) != sizeof(*header) || fdatasync(fd) != 0) return errno ? -errno : -EIO;
+    return 0;
+}
+
+// Write the inodes changed since the last checkpoint to the next segment
+// and point the journal past them. Returns 0 or -errno; on failure the
+// inodes stay dirty and the journal still covers them.
+static int checkpoint_run(void) {
+    double start = journal_now();
+    pthread_rwlock_wrlock(&change_lock);
+    int *inodes;
+    int count = checkpoint_take_dirty(&inodes);
+    snapshot *s = count > 0 ? snapshot_take_locked() : NULL;
+    pthread_mutex_lock(&journal_mutex);
+    int64_t cut = journal.start + journal.appended;
+    pthread_mutex_unlock(&journal_mutex);
+    pthread_rwlock_unlock(&change_lock);
+    checkpoint_note_pause(start);
+    if (count <= 0) return count;
+
+    binary_image_parts parts = { 0 };
+    char *seg = segment_path(journal_header.checkpoint + 1);
+    int res = s ? binary_image_collect(s, inodes, count, true, &parts) : -ENOMEM;
+    if (res == 0) res = binary_image_write(seg, BINARY_IMAGE_PARTIAL, &parts, s, NULL);
+    snapshot_release(s);
+    if (res == 0) res = sync_parent_dir(seg);
+    // The header must not point past the end of the file.
+    if (res == 0) res = journal_sync();
+    if (res == 0) {
+        journal_file_header header = journal_header;
+        header.checkpoint++;
+        header.replay_from = cut;
+        res = journal_write_header(journal_fd, &header);
+        if (res == 0) journal_header = header;
+    }
+    free(seg);
+
+    if (res != 0) {
+        fprintf(stderr, "Checkpoint failed: %s\n", strerror(-res));
+        for (int i = 0; i < count; i++) mark_dirty(inodes[i]);
+    } else {
+        double elapsed = journal_now() - start;
+        checkpoint_stats.checkpoints++;
+        checkpoint_stats.inodes += count;
+        checkpoint_stats.bytes += sizeof(binary_image_header) + parts.records.len + parts.entries.len + parts.extents.len + parts.strings.len + parts.data_size;
+        checkpoint_stats.time_total += elapsed;
+        if (elapsed > checkpoint_stats.time_max) checkpoint_stats.time_max = elapsed;
+    }
+    binary_image_parts_free(&parts);
+    free(inodes);
+    return res;
+}
+
+// JSON has no way to say a file has holes, so a JSON image spells them
+// out as zeros, six bytes of escape each. A compaction into one is skipped
+// while the holes add up to more than this, and to more than the data
+// actually stored.
+#define COMPACT_JSON_MAX_HOLES ((uint64_t)16 << 20)
+
+// True if writing snapshot s as JSON would mostly write zeros for holes.
+static bool snapshot_too_sparse_for_json(snapshot *s) {
+    uint64_t stored = 0, holes = 0;
+    for (int i = 0; i < s->num_objects; i++) {
+        bool locked;
+        const fs_object *obj = snapshot_view(s, i, &locked);
+        if (obj->type == FS_REG) {
+            uint64_t file_stored = 0;
+            size_t len;
+            for (size_t pos = file_next_data(obj, 0, &len); len > 0; pos = file_next_data(obj, pos + len, &len)) {
+                file_stored += len;
+            }
+            stored += file_stored;
+            holes += obj->size - file_stored;
+        }
+        snapshot_view_done(obj, locked);
+    }
+    return holes > COMPACT_JSON_MAX_HOLES && holes > stored;
+}
+
+// Write the file system as of snapshot s next to the image, in the
+// image's format, and sync it. Sets *tmp to the file's name.
+static int checkpoint_write_image(snapshot *s, char **tmp) {
+    if (is_binary_image(journal_image_path)) return store_snapshot_binary(s, journal_image_path, tmp);
+    return store_snapshot_json(s, journal_image_path, tmp);
+}
+
+// Copy the journal records from file offset cut to the end (all written
+// out) into fd, after the header. Returns the new end offset or -errno.
+static off_t journal_copy_tail(int fd, off_t cut, off_t end) {
+    char buf[65536];
+    off_t out = sizeof(journal_file_header);
+    while (cut < end) {
+        size_t want = end - cut < (off_t)sizeof(buf) ? (size_t)(end - cut) : sizeof(buf);
+        ssize_t n = pread(journal_fd, buf, want, cut);
+        if (n <= 0) return n < 0 ? -errno : -EIO;
+        if (pwrite(fd, buf, n, out) != n) return -EIO;
+        cut += n;
+        out += n;
+    }
+    return out;
+}
+
+// Merge the image and the segments into a new image with a new journal.
+// Writers keep going while the image is written from a snapshot; they
+// only pause while the journal records written meanwhile are carried over.
+// Returns 0 or -errno.
+//
+// This is also how a failed journal is recovered. Its file can't be
+// trusted for the records after the snapshot, so appends switch to the new
+// journal as the snapshot is taken, and nothing needs carrying over. fsync
+// keeps failing until the new image and journal are in place.
+static int checkpoint_compact(void) {
+    char *tmp = NULL, *new_path = journal_new_path();
+    // The identity of the new image is filled in once it is written. Until
+    // then the new journal matches no image and is never replayed.
+    journal_file_header header = {
+        .magic = JOURNAL_MAGIC,
+        .checkpoint = 0,
+        .replay_from = sizeof(journal_file_header),
+    };
+    int res = 0;
+    int fd = open(new_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, &header, sizeof(header)) != sizeof(header)) res = errno ? -errno : -EIO;
+
+    double start = journal_now();
+    pthread_rwlock_wrlock(&change_lock);
+    // Everything so far goes into the new image. Kept to mark again if
+    // the compaction fails.
+    int *inodes;
+    int count = checkpoint_take_dirty(&inodes);
+    snapshot *s = count >= 0 && res == 0 ? snapshot_take_locked() : NULL;
+    pthread_mutex_lock(&journal_mutex);
+    bool recover = s && journal.failed;
+    if (recover) {
+        // Everything appended so far is in the snapshot, written or not.
+        while (journal.committing) pthread_cond_wait(&journal_cond, &journal_mutex);
+        if (dup2(fd, journal_fd) < 0) {
+            res = -errno;
+        } else {
+            journal.buf.len = 0;
+            journal.start = sizeof(journal_file_header) - (int64_t)journal.appended;
+            journal.synced = journal.appended;
+            journal.failed = false;
+            journal.recovering = true;
+        }
+    }
+    int64_t cut = journal.start + journal.appended;
+    pthread_mutex_unlock(&journal_mutex);
+    pthread_rwlock_unlock(&change_lock);
+    checkpoint_note_pause(start);
+
+    // Segments keep the holes, so they are left to pile up instead. A failed
+    // journal is replaced regardless.
+    if (res == 0 && s && !recover && !is_binary_image(journal_image_path) && snapshot_too_sparse_for_json(s)) {
+        static bool warned;
+        if (!warned) {
+            fprintf(stderr, "Not compacting into %s: its sparse files would be written out as zeros. "
+                            "Convert the image to a binary image to compact it.\n", journal_image_path);
+            warned = true;
+        }
+        res = -EFBIG;
+    }
+    if (res == 0) res = s ? checkpoint_write_image(s, &tmp) : -ENOMEM;
+    snapshot_release(s);
+
+    struct stat st;
+    if (res == 0 && stat(tmp, &st) != 0) res = -errno;
+    if (res == 0) {
+        header.image_size = st.st_size;
+        header.image_mtime_sec = st.st_mtim.tv_sec;
+        header.image_mtime_nsec = st.st_mtim.tv_nsec;
+        if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) res = errno ? -errno : -EIO;
+    }
+
+    // Stop writers and carry over what they journaled since the snapshot.
+    double switch_start = journal_now();
+    pthread_rwlock_wrlock(&change_lock);
+    if (res == 0) res = journal_commit();
+    off_t end = 0;
+    if (res == 0) {
+        pthread_mutex_lock(&journal_mutex);
+        end = journal.start + journal.appended;
+        pthread_mutex_unlock(&journal_mutex);
+        // When recovering, the records are in the new journal already.
+        if (!recover) end = journal_copy_tail(fd, cut, end);
+        if (end < 0) res = end;
+    }
+    if (res == 0 && (lseek(fd, end, SEEK_SET) < 0 || fsync(fd) != 0)) res = -errno;
+    // Once the image is replaced the new journal is the one that matches
+    // it, whether or not it has been renamed into place yet.
+    if (res == 0 && rename(tmp, journal_image_path) != 0) res = -errno;
+    if (res != 0) {
+        if (recover) {
+            // Appends stay on the new journal, which the next attempt
+            // replaces. The journal that matches the image lacks them.
+            pthread_mutex_lock(&journal_mutex);
+            journal.failed = true;
+            journal.recovering = false;
+            pthread_mutex_unlock(&journal_mutex);
+        }
+        pthread_rwlock_unlock(&change_lock);
+        if (tmp) unlink(tmp);
+        unlink(new_path);
+        if (fd >= 0) close(fd);
+        for (int i = 0; i < count; i++) mark_dirty(inodes[i]);
+        // A skipped compaction has said why once already.
+        if (res != -EFBIG) fprintf(stderr, "Compaction failed: %s\n", strerror(-res));
+    } else {
+        if (rename(new_path, journal_path) != 0 || sync_parent_dir(journal_path) != 0) {
+            fprintf(stderr, "Failed to replace journal %s: %s\n", journal_path, strerror(errno));
+        }
+
+        // Swap the new journal in behind the same descriptor.
+        pthread_mutex_lock(&journal_mutex);
+        while (journal.committing) pthread_cond_wait(&journal_cond, &journal_mutex);
+        if (dup2(fd, journal_fd) < 0) {
+            // Appends go on to the replaced journal, so the new one that
+            // matches the image lacks them. The next compaction retries.
+            fprintf(stderr, "Failed to switch to journal %s: %s\n", journal_path, strerror(errno));
+            journal.failed = true;
+            journal.recovering = false;
+        } else {
+            journal.start = end - (int64_t)journal.appended;
+        }
+        if (recover && !journal.failed) {
+            journal.recovering = false;
+            fprintf(stderr, "Journal recovered: started a new one on a full image\n");
+        }
+        pthread_mutex_unlock(&journal_mutex);
+        close(fd);
+        pthread_rwlock_unlock(&change_lock);
+
+        for (uint64_t n = journal_header.checkpoint; n > 0; n--) {
+            char *seg = segment_path(n);
+            unlink(seg);
+            free(seg);
+        }
+        journal_header = header;
+        checkpoint_stats.compactions++;
+    }
+    checkpoint_note_pause(switch_start);
+
+    free(tmp);
+    free(new_path);
+    free(inodes);
+    return res;
+}
+
+static void *checkpoint_main(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&checkpoint_mutex);
+    while (!checkpoint_stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += checkpoint_interval;
+        while (!checkpoint_stopping &&
+               pthread_cond_timedwait(&checkpoint_cond, &checkpoint_mutex, &deadline) != ETIMEDOUT) {
+        }
+        if (checkpoint_stopping) break;
+
+        pthread_mutex_unlock(&checkpoint_mutex);
+        // A failed journal is replaced by a compaction, whatever
+        // compact_segments says: checkpoints need it to be intact.
+        if (journal_failed()) {
+            checkpoint_compact();
+        } else if (checkpoint_run() == 0 && compact_segments > 0 && journal_header.checkpoint >= (uint64_t)compact_segments) {
+            checkpoint_compact();
+        }
+        pthread_mutex_lock(&checkpoint_mutex);
+    }
+    pthread_mutex_unlock(&checkpoint_mutex);
+    return NULL;
+}
+
+static void checkpoint_start(void) {
+    if (!checkpoints_on) return;
+    if (pthread_create(&checkpoint_thread, NULL, checkpoint_main, NULL) != 0) {
+        fprintf(stderr, "Failed to start the checkpoint thread; the journal will not be checkpointed\n");
+        return;
+    }
+    checkpoint_thread_started = true;
+}
+
+static void checkpoint_stop(void) {
+    if (!checkpoint_thread_started) return;
+    pthread_mutex_lock(&checkpoint_mutex);
+    checkpoint_stopping = true;
+    pthread_cond_signal(&checkpoint_cond);
+    pthread_mutex_unlock(&checkpoint_mutex);
+    pthread_join(checkpoint_thread, NULL);
+    checkpoint_thread_started = false;
+}
+
+static void checkpoint_print_stats(void) {
+    if (!checkpoints_on) return;
+    unsigned long n = checkpoint_stats.checkpoints;
+    fprintf(stderr, "checkpoints: %lu (%lu inodes, %.1f MiB), %lu compactions, time avg %.3f ms, max %.3f ms, longest writer pause %.3f ms\n",
+            n, checkpoint_stats.inodes, checkpoint_stats.bytes / 1048576.0, checkpoint_stats.compactions,
+            n ? checkpoint_stats.time_total / n * 1000 : 0.0, checkpoint_stats.time_max * 1000, checkpoint_stats.pause_max * 1000);
+}
+
+// Named snapshots. Setting the extended attribute user.jsonfs.snapshot on
+// the root directory to NAME takes a snapshot and returns; a background
+// thread then writes it as the binary image <image>.snapshot.NAME, which
+// is kept until it is deleted and can be mounted read-only with
+// -o snapshot=NAME.
+#define SNAPSHOT_XATTR "user.jsonfs.snapshot"
+
+static const char *image_path = "fs.json";  // made absolute at mount
+static bool read_only;  // mounted from a named snapshot
+
+static int snapshot_writers;  // named snapshots still being written, under snapshot_mutex
+static pthread_cond_t snapshot_writers_cond = PTHREAD_COND_INITIALIZER;
+
+typedef struct {
+    snapshot *s;
+    char *path;
+} snapshot_job;
+
+static char *snapshot_image_path(const char *image, const char *name) {
+    size_t len = strlen(image) + sizeof(".snapshot.") + strlen(name);
+    char *path = malloc(len);
+    if (path) snprintf(path, len, "%s.snapshot.%s", image, name);
+    return path;
+}
+
+static void *snapshot_write_main(void *arg) {
+    snapshot_job *job = arg;
+    if (store_snapshot_binary(job->s, job->path, NULL) == 0) {
+        fprintf(stderr, "Snapshot written to %s\n", job->path);
+    }
+    snapshot_release(job->s);
+    free(job->path);
+    free(job);
+
+    pthread_mutex_lock(&snapshot_mutex);
+    snapshot_writers--;
+    pthread_cond_broadcast(&snapshot_writers_cond);
+    pthread_mutex_unlock(&snapshot_mutex);
+    return NULL;
+}
+
+// Take a snapshot named name and start writing it. Returns 0 or -errno.
+static int snapshot_named(const char *name) {
+    snapshot_job *job = calloc(1, sizeof(snapshot_job));
+    if (job) job->path = snapshot_image_path(image_path, name);
+    if (!job || !job->path) {
+        free(job);
+        return -ENOMEM;
+    }
+    job->s = snapshot_take();
+    if (!job->s) {
+        free(job->path);
+        free(job);
+        return -ENOMEM;
+    }
+
+    pthread_mutex_lock(&snapshot_mutex);
+    snapshot_writers++;
+    pthread_mutex_unlock(&snapshot_mutex);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    int res = pthread_create(&thread, &attr, snapshot_write_main, job);
+    pthread_attr_destroy(&attr);
+    if (res != 0) snapshot_write_main(job);  // write it here instead
+    return 0;
+}
+
+// Wait for named snapshots still being written.
+static void snapshot_wait_writers(void) {
+    pthread_mutex_lock(&snapshot_mutex);
+    while (snapshot_writers > 0) pthread_cond_wait(&snapshot_writers_cond, &snapshot_mutex);
+    pthread_mutex_unlock(&snapshot_mutex);
+}
+
+#if FUSE_USE_VERSION >= 30
+// Kernel features negotiated at init, each with a mount option so they can
+// be compared one at a time. The names are libfuse's: splice_write sends
+// read replies to the kernel through a pipe, splice_read receives write
+// requests through one. Our data is in memory, so splicing saves no copy
+// and both are off by default.
+#define DEFAULT_MAX_WRITE (1 << 20)
+static int writeback_cache = 1;
+static int parallel_dirops = 1;
+static const char *readdirplus = "auto";  // yes, no or auto
+static int splice_read;
+static int splice_write;
+static int max_write = DEFAULT_MAX_WRITE;
+
+// Ask for cap if enable is set and the kernel offers it, and make sure it
+// is off otherwise: libfuse turns some features on by default.
+static void conn_want(struct fuse_conn_info *conn, unsigned int cap, bool enable) {
+    if (enable && (conn->capable & cap)) {
+        conn->want |= cap;
+    } else {
+        conn->want &= ~cap;
+    }
+}
+#endif
+
+static void fuse_example_init(void *userdata, struct fuse_conn_info *conn) {
+    (void) userdata;
+#if FUSE_USE_VERSION >= 30
+    // With writeback caching, writes return once they are in the page
+    // cache, and reach us (and the journal) in larger batches when the
+    // kernel writes them back. fsync and close still write them back first.
+    conn_want(conn, FUSE_CAP_WRITEBACK_CACHE, writeback_cache);
+    conn_want(conn, FUSE_CAP_PARALLEL_DIROPS, parallel_dirops);
+    // "auto" lets the kernel switch between readdir and readdirplus by
+    // whether the attributes get used.
+    conn_want(conn, FUSE_CAP_READDIRPLUS, strcmp(readdirplus, "no") != 0);
+    conn_want(conn, FUSE_CAP_READDIRPLUS_AUTO, strcmp(readdirplus, "auto") == 0);
+    // One capability at a time: the kernel may offer one without the other.
+    // Moving pages only applies to writes that are spliced.
+    conn_want(conn, FUSE_CAP_SPLICE_WRITE, splice_write);
+    conn_want(conn, FUSE_CAP_SPLICE_MOVE, splice_write && (conn->want & FUSE_CAP_SPLICE_WRITE));
+    conn_want(conn, FUSE_CAP_SPLICE_READ, splice_read);
+    // libfuse caps this at its buffer size and raises the kernel's
+    // max_pages to match, which bounds reads as well as writes.
+    conn->max_write = max_write;
+#else
+    (void) conn;
+#endif
+    // Started here and not in main, which runs before libfuse forks into
+    // the background.
+    checkpoint_start();
+}
+
+static bool mounted_binary_image;  // save as a binary image too
+
+static void fuse_example_destroy(void *userdata) {
+    (void) userdata;
+    checkpoint_stop();
+    snapshot_wait_writers();
+    journal_sync();
+    journal_print_stats();
+    checkpoint_print_stats();
+    if (read_only) {
+        // Nothing can have changed.
+    } else if (mounted_binary_image) {
+        store_binary_image("fs_edited.img");
+    } else {
+        store_file_system("fs_edited.json");
+    }
+    lookup_cache_print_stats();
+}
+
+// The kernel names objects by node ID. FUSE_ROOT_ID is 1 and the root is
+// inode 0, so a node ID is the inode number plus one. The kernel only
+// sends IDs we gave it, and those stay valid until it forgets them.
+static int node_inode(fuse_ino_t ino) {
+    return (int)(ino - FUSE_ROOT_ID);
+}
+
+static fuse_ino_t node_id(int inode) {
+    return (fuse_ino_t)inode + FUSE_ROOT_ID;
+}
+
+// Return the object in slot inode with its read or write lock held, or
+// NULL if the slot is free. Inodes the kernel still holds lookups on are
+// never freed, so NULL only comes from callers that pass other numbers.
+static fs_object *lock_inode(int inode, bool write) {
+    fs_object *obj = fs_obj(inode);
+    if (write) {
+        pthread_rwlock_wrlock(&obj->lock);
+    } else {
+        pthread_rwlock_rdlock(&obj->lock);
+    }
+    if (obj->type == FS_FREE) {
+        pthread_rwlock_unlock(&obj->lock);
+        return NULL;
+    }
+    return obj;
+}
+
+// Find name in directory parent. No directory locks are taken; the walk
+// runs inside an epoch so nothing it reads can be freed underneath it.
+// Misses are remembered in the negative cache. Returns the inode, or
+// -ENOENT or -ENOTDIR.
+static int dir_lookup_cached(int parent, const char *name) {
+    epoch_enter();
+    // Read the version before the entries: if a writer changes the
+    // directory after this point, whatever we cache is already stale.
+    fs_object *dir_obj = fs_obj(parent);
+    unsigned long version = atomic_load_explicit(&dir_obj->version, memory_order_acquire);
+    fs_dir *dir = __atomic_load_n(&dir_obj->dir, __ATOMIC_ACQUIRE);
+    int inode;
+    if (!dir) {
+        inode = -ENOTDIR;
+    } else if (neg_cache_lookup(parent, name)) {
+        inode = -ENOENT;
+    } else {
+        inode = dir_lookup(dir, name);
+        if (inode < 0) {
+            neg_cache_insert(parent, name, version);
+            inode = -ENOENT;
+        }
+    }
+    epoch_exit();
+    return inode;
+}
+
+static void node_stat(const fs_object *obj, struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = node_id(obj->inode);
+    if (obj->type == FS_REG) {
+        stbuf->st_mode = S_IFREG | 0666;
+        stbuf->st_nlink = obj->nlink;
+        stbuf->st_size = obj->size;
+        stbuf->st_blksize = CHUNK_SIZE;
+        // Holes take no space; data still only in an image counts in full.
+        size_t stored = obj->allocated + obj->mapped_stored + (file_unloaded(obj) ? obj->size : 0);
+        stbuf->st_blocks = (stored + 511) / 512;
+    } else {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+    }
+}
+
+// Look name up in directory parent, fill *stbuf and count a lookup for the
+// kernel. Returns the inode or a negative errno. Only the inode found is
+// locked, and the name is checked again under its lock: inode numbers are
+// reused, so the slot may have been freed and handed to a new object in
+// between. An object can't be unlinked while we hold its lock; if the name
+// still leads here, it is the right one.
+static int node_lookup(int parent, const char *name, struct stat *stbuf) {
+    for (;;) {
+        int inode = dir_lookup_cached(parent, name);
+        if (inode < 0) return inode;
+
+        fs_object *obj = fs_obj(inode);
+        pthread_rwlock_rdlock(&obj->lock);
+        if (obj->type != FS_FREE && dir_lookup_cached(parent, name) == inode) {
+            node_stat(obj, stbuf);
+            atomic_fetch_add_explicit(&obj->nlookup, 1, memory_order_relaxed);
+            pthread_rwlock_unlock(&obj->lock);
+            return inode;
+        }
+        pthread_rwlock_unlock(&obj->lock);
+    }
+}
+
+// Drop n of the kernel's lookups on inode. An unlinked inode is freed with
+// the last one.
+static void node_forget(int inode, unsigned long n) {
+    fs_object *obj = fs_obj(inode);
+    if (atomic_fetch_sub_explicit(&obj->nlookup, n, memory_order_acq_rel) != n) return;
+
+    // Checked again under the lock: unlink may be deciding right now
+    // whether to free the inode itself.
+    pthread_rwlock_wrlock(&obj->lock);
+    bool freed = obj->unlinked && atomic_load_explicit(&obj->nlookup, memory_order_relaxed) == 0;
+    if (freed) free_fs_object(obj);
+    pthread_rwlock_unlock(&obj->lock);
+    if (freed) release_inode(inode);
+}
+
+static int node_getattr(int inode, struct stat *stbuf) {
+    fs_object *obj = lock_inode(inode, false);
+    if (!obj) return -ENOENT;
+    node_stat(obj, stbuf);
+    pthread_rwlock_unlock(&obj->lock);
+    return 0;
+}
+
+// Changes to an unlinked inode are not journaled: replay has nothing to
+// apply them to, and nothing reaches the image either.
+static int node_write(int inode, const char *buf, size_t size, off_t offset) {
+    change_begin();
+    fs_object *obj = lock_inode(inode, true);
+    if (!obj) {
+        change_end();
+        return -ENOENT;
+    }
+
+    int res;
+    if (obj->type != FS_REG) {
+        res = -EISDIR;
+    } else if ((res = file_load(obj)) == 0) {
+        snapshot_preserve(obj, inode);
+        file_detach_image(obj);
+        // Only the chunks covering [offset, offset + size) are touched;
+        // writing past the end leaves a hole instead of zero-filling.
+        res = file_write(obj, buf, size, offset);
+        if (res == 0 && !obj->unlinked) journal_append(JOURNAL_WRITE, inode, -1, offset, buf, size);
+    }
+
+    pthread_rwlock_unlock(&obj->lock);
+    change_end();
+    return res == 0 ? (int)size : res;
+}
+
+static int node_truncate(int inode, off_t newsize) {
+    change_begin();
+    fs_object *obj = lock_inode(inode, true);
+    if (!obj) {
+        change_end();
+        return -ENOENT;  // No such file or directory
+    }
+
+    int res = 0;
+    if (obj->type != FS_REG) {
+        res = -EISDIR;
+        goto out;
+    }
+
+    // Truncating to zero doesn't need the old data.
+    if (newsize != 0) res = file_load(obj);
+    if (res != 0) goto out;
+    snapshot_preserve(obj, inode);
+    file_detach_image(obj);
+
+    // Resize the data.
+    res = file_resize(obj, newsize);
+    if (res == 0 && !obj->unlinked) journal_append(JOURNAL_TRUNCATE, inode, -1, newsize, NULL, 0);
+
+out:
+    pthread_rwlock_unlock(&obj->lock);
+    change_end();
+    return res;
+}
+
+// Create an empty file or directory called name in directory parent, fill
+// *stbuf and count a lookup for the kernel. Returns the new inode or a
+// negative errno.
+static int node_create(int parent, const char *name, fs_type type, struct stat *stbuf) {
+    int res;
+
+    change_begin();
+    fs_object *parent_obj = lock_inode(parent, true);
+    if (!parent_obj) {
+        res = -ENOENT;
+        goto out;
+    }
+    if (parent_obj->type != FS_DIR) {
+        res = -ENOTDIR;
+        goto out_unlock;
+    }
+    // Removed, but still open or the kernel's working directory.
+    if (parent_obj->unlinked) {
+        res = -ENOENT;
+        goto out_unlock;
+    }
+
+    if (dir_lookup(parent_obj->dir, name) >= 0) {
+        res = -EEXIST;
+        goto out_unlock;
+    }
+
+    // Allocate a new fs_object.
+    int inode = alloc_inode();
+    if (inode < 0) {
+        res = inode;
+        goto out_unlock;
+    }
+
+    // Initialize the new fs_object. Initially, a file has no data and a
+    // directory no entries.
+    fs_object *new_obj = fs_obj(inode);
+    pthread_rwlock_wrlock(&new_obj->lock);
+    snapshot_preserve(parent_obj, parent);
+    snapshot_preserve(new_obj, inode);
+    new_obj->inode = inode;
+    new_obj->type = type;
+    new_obj->size = 0;
+    new_obj->name = NULL;
+    if (type == FS_DIR) {
+        __atomic_store_n(&new_obj->dir, dir_new(), __ATOMIC_RELEASE);
+    } else {
+        file_init_data(new_obj);
+    }
+
+    // Add the new object to its parent directory.
+    res = type != FS_DIR || new_obj->dir ? dir_add(parent_obj, name, inode) : -ENOMEM;
+    if (res != 0) {
+        free_fs_object(new_obj);
+        pthread_rwlock_unlock(&new_obj->lock);
+        release_inode(inode);
+        goto out_unlock;
+    }
+    new_obj->nlink = 1;
+    atomic_store_explicit(&new_obj->nlookup, 1, memory_order_relaxed);
+    journal_append_name(type == FS_DIR ? JOURNAL_MKDIR : JOURNAL_CREATE, inode, parent, name);
+    node_stat(new_obj, stbuf);
+    pthread_rwlock_unlock(&new_obj->lock);
+    neg_cache_invalidate(parent, name);
+    res = inode;
+
+out_unlock:
+    pthread_rwlock_unlock(&parent_obj->lock);
+out:
+    change_end();
+    return res;
+}
+
+// Remove name from directory parent and drop a link on its inode. With
+// dir_only set, only empty directories are removed (rmdir); otherwise
+// anything but a non-empty directory is (unlink). The inode is freed with
+// its last link unless the kernel still holds lookups on it, in which case
+// the last forget frees it.
+static int node_remove(int parent, const char *name, bool dir_only) {
+    int res = 0;
+    bool freed = false;
+
+    change_begin();
+    fs_object *parent_obj = lock_inode(parent, true);
+    if (!parent_obj || parent_obj->type != FS_DIR) {
+        if (parent_obj) pthread_rwlock_unlock(&parent_obj->lock);
+        change_end();
+        return parent_obj ? -ENOTDIR : -ENOENT;
+    }
+
+    int inode = dir_lookup(parent_obj->dir, name);
+    if (inode < 0) {
+        pthread_rwlock_unlock(&parent_obj->lock);
+        change_end();
+        return -ENOENT;
+    }
+
+    // Lock order: parent before child.
+    fs_object *obj = fs_obj(inode);
+    pthread_rwlock_wrlock(&obj->lock);
+
+    if (dir_only && obj->type != FS_DIR) {
+        res = -ENOTDIR;
+    } else if (obj->type == FS_DIR && obj->dir->num_entries > 0) {
+        res = -ENOTEMPTY;
+    } else {
+        // Remove the entry for this object from its parent directory.
+        snapshot_preserve(parent_obj, parent);
+        snapshot_preserve(obj, inode);
+        dir_remove(parent_obj, name);
+        // Logged before the inode can be handed out again.
+        journal_append_name(dir_only ? JOURNAL_RMDIR : JOURNAL_UNLINK, inode, parent, name);
+
+        // Other hard links may still point at the inode; free it with the last one.
+        if (--obj->nlink == 0) {
+            if (atomic_load_explicit(&obj->nlookup, memory_order_acquire) == 0) {
+                free_fs_object(obj);
+                freed = true;
+            } else {
+                obj->unlinked = true;
+            }
+        }
+    }
+
+    pthread_rwlock_unlock(&obj->lock);
+    pthread_rwlock_unlock(&parent_obj->lock);
+    change_end();
+    if (freed) release_inode(inode);
+    return res;
+}
+
+// How long the kernel may cache lookups and attributes, and lookups that
+// found nothing. Changed with -o entry_timeout=SECS, -o attr_timeout=SECS
+// and -o negative_timeout=SECS. Only this process changes the file system,
+// so caching is always safe; the timeouts only bound how stale a view of
+// another mount of the same image can get.
+#define DEFAULT_ENTRY_TIMEOUT 1.0
+#define DEFAULT_ATTR_TIMEOUT 1.0
+#define DEFAULT_NEGATIVE_TIMEOUT 1.0
+static double entry_timeout = DEFAULT_ENTRY_TIMEOUT;
+static double attr_timeout = DEFAULT_ATTR_TIMEOUT;
+static double negative_timeout = DEFAULT_NEGATIVE_TIMEOUT;
+
+static void node_entry(struct fuse_entry_param *e, int inode, const struct stat *stbuf) {
+    memset(e, 0, sizeof(*e));
+    e->ino = node_id(inode);
+    e->attr = *stbuf;
+    e->attr_timeout = attr_timeout;
+    e->entry_timeout = entry_timeout;
+}
+
+static void fuse_example_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fuse_entry_param e;
+    struct stat stbuf;
+    int inode = node_lookup(node_inode(parent), name, &stbuf);
+    if (inode == -ENOENT) {
+        // An entry with node ID 0 lets the kernel cache the miss, so
+        // repeated probes of missing paths don't reach us at all.
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = negative_timeout;
+        fuse_reply_entry(req, &e);
+    } else if (inode < 0) {
+        fuse_reply_err(req, -inode);
+    } else {
+        node_entry(&e, inode, &stbuf);
+        fuse_reply_entry(req, &e);
+    }
+}
+
+#if FUSE_USE_VERSION >= 30
+static void fuse_example_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+#else
+static void fuse_example_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+#endif
+    node_forget(node_inode(ino), nlookup);
+    fuse_reply_none(req);
+}
+
+#if FUSE_USE_VERSION >= 30
+static void fuse_example_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    for (size_t i = 0; i < count; i++) {
+        node_forget(node_inode(forgets[i].ino), forgets[i].nlookup);
+    }
+    fuse_reply_none(req);
+}
+#endif
+
+static void fuse_example_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void) fi;
+    struct stat stbuf;
+    int res = node_getattr(node_inode(ino), &stbuf);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        fuse_reply_attr(req, &stbuf, attr_timeout);
+    }
+}
+
+// Only the size can be changed. Timestamps aren't kept, so setting them
+// succeeds and does nothing; there is nothing to chmod or chown either.
+static void fuse_example_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                                 struct fuse_file_info *fi) {
+    (void) fi;
+    int inode = node_inode(ino);
+    int res = 0;
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        res = -ENOSYS;
+    } else if (to_set & FUSE_SET_ATTR_SIZE) {
+        res = node_truncate(inode, attr->st_size);
+    }
+
+    struct stat stbuf;
+    if (res == 0) res = node_getattr(inode, &stbuf);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        fuse_reply_attr(req, &stbuf, attr_timeout);
+    }
+}
+
+static void fuse_example_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+//    if ((fi->flags & 3) != O_RDONLY) {
+//        fuse_reply_err(req, EACCES);  // Access denied
+//        return;
+//    }
+
+    struct stat stbuf;
+    int res = node_getattr(node_inode(ino), &stbuf);
+    if (res == 0 && S_ISDIR(stbuf.st_mode)) res = -EISDIR;
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        fuse_reply_open(req, fi);
+    }
+}
+
+static void reply_iov(fuse_req_t req, const struct iovec *iov, int count) {
+#if FUSE_USE_VERSION >= 30
+    if (splice_write && count > 0) {
+        struct fuse_bufvec *bufv = calloc(1, sizeof(struct fuse_bufvec) + count * sizeof(struct fuse_buf));
+        if (bufv) {
+            for (int i = 0; i < count; i++) {
+                bufv->buf[i].size = iov[i].iov_len;
+                bufv->buf[i].mem = iov[i].iov_base;
+            }
+            bufv->count = count;
+            // Our pages are only referenced by the pipe, never moved, and
+            // the lock keeps them unchanged until the reply has gone out.
+            fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+            free(bufv);
+            return;
+        }
+    }
+#endif
+    fuse_reply_iov(req, iov, count);
+}
+
+// The reply is sent straight from the file's chunks (or the mapped image)
+// with the lock still held, so the data is never copied into a buffer of
+// our own.
+static void fuse_example_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                              struct fuse_file_info *fi) {
+    (void) fi;
+    int inode = node_inode(ino);
+    fs_object *obj = lock_inode(inode, false);
+
+    // Loading the data from the image needs the write lock.
+    if (obj && obj->type == FS_REG && file_unloaded(obj)) {
+        pthread_rwlock_unlock(&obj->lock);
+        obj = lock_inode(inode, true);
+    }
+
+    int res = !obj ? -ENOENT : obj->type != FS_REG ? -EISDIR : file_load(obj);
+    struct iovec *iov = res == 0 ? malloc(file_read_iov_max(size) * sizeof(struct iovec)) : NULL;
+    if (res == 0 && !iov) res = -ENOMEM;
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        __atomic_store_n(&obj->image_referenced, true, __ATOMIC_RELAXED);
+        reply_iov(req, iov, file_read_iov(obj, iov, size, offset));
+    }
+
+    if (obj) pthread_rwlock_unlock(&obj->lock);
+    free(iov);
+}
+
+// Add one entry to a readdir reply. Returns false once the buffer is full.
+// A readdirplus entry (plus) also carries the attributes of inode child
+// and counts a lookup on it, which saves the kernel a lookup per entry.
+// child is -1 for "." and "..", which go out with node ID 0 and so aren't
+// counted. The caller holds the directory's lock.
+static bool readdir_add(fuse_req_t req, char *buf, size_t size, size_t *len, const char *name,
+                        fuse_ino_t ino, int child, off_t cookie, bool plus) {
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.attr.st_ino = ino;
+    // The children's types can't change while we hold the parent's lock:
+    // an inode is only freed after its entry is removed.
+    e.attr.st_mode = child < 0 || fs_obj(child)->type == FS_DIR ? S_IFDIR : S_IFREG;
+
+#if FUSE_USE_VERSION >= 30
+    if (plus) {
+        // Check for room first: an entry that doesn't fit must not count.
+        size_t entry_len = fuse_add_direntry_plus(req, NULL, 0, name, NULL, 0);
+        if (entry_len > size - *len) return false;
+        if (child >= 0) {
+            // Lock order: parent before child.
+            struct stat stbuf;
+            fs_object *obj = fs_obj(child);
+            pthread_rwlock_rdlock(&obj->lock);
+            node_stat(obj, &stbuf);
+            atomic_fetch_add_explicit(&obj->nlookup, 1, memory_order_relaxed);
+            pthread_rwlock_unlock(&obj->lock);
+            node_entry(&e, child, &stbuf);
+        }
+        fuse_add_direntry_plus(req, buf + *len, size - *len, name, &e, cookie);
+        *len += entry_len;
+        return true;
+    }
+#else
+    (void) plus;
+#endif
+
+    size_t entry_len = fuse_add_direntry(req, buf + *len, size - *len, name, &e.attr, cookie);
+    if (entry_len > size - *len) return false;
+    *len += entry_len;
+    return true;
+}
+
+// Entries are passed to the kernel with their cookies as offsets, so a
+// large directory is listed a buffer at a time: each call resumes after
+// the offset of the last entry the kernel took.
+static void reply_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, bool plus) {
+    fs_object *obj = lock_inode(node_inode(ino), false);
+    if (!obj) {
+        fuse_reply_err(req, ENOENT);  // No such file or directory
+        return;
+    }
+    if (obj->type != FS_DIR) {
+        pthread_rwlock_unlock(&obj->lock);
+        fuse_reply_err(req, ENOTDIR);  // Not a directory
+        return;
+    }
+    char *buf = malloc(size);
+    if (!buf) {
+        pthread_rwlock_unlock(&obj->lock);
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    // Parents aren't tracked, and the kernel answers ".." itself; the
+    // entry only needs a node ID that isn't 0.
+    size_t len = 0;
+    if (offset < 1 && !readdir_add(req, buf, size, &len, ".", ino, -1, 1, plus)) goto out;
+    if (offset < 2 && !readdir_add(req, buf, size, &len, "..", ino, -1, 2, plus)) goto out;
+
+    const fs_dir *dir = obj->dir;
+    for (int c = dir_chunk_find(dir, offset + 1); c < dir->num_chunks; c++) {
+        const fs_dir_chunk *chunk = dir->chunks[c];
+        for (int i = dir_chunk_pos(chunk, offset + 1); i < chunk->count; i++) {
+            const fs_dentry *entry = chunk->entries[i];
+            if (!readdir_add(req, buf, size, &len, entry->name, node_id(entry->inode), entry->inode, entry->cookie, plus)) goto out;
+        }
+    }
+
+out:
+    pthread_rwlock_unlock(&obj->lock);
+    fuse_reply_buf(req, buf, len);
+    free(buf);
+}
+
+static void fuse_example_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                                 struct fuse_file_info *fi) {
+    (void) fi;
+    reply_readdir(req, ino, size, offset, false);
+}
+
+#if FUSE_USE_VERSION >= 30
+static void fuse_example_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                                     struct fuse_file_info *fi) {
+    (void) fi;
+    reply_readdir(req, ino, size, offset, true);
+}
+#endif
+
+static void fuse_example_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset,
+                               struct fuse_file_info *fi) {
+    (void) fi;
+    int res = node_write(node_inode(ino), buf, size, offset);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        fuse_reply_write(req, res);
+    }
+}
+
+#if FUSE_USE_VERSION >= 30
+// With splice_read the data may arrive in a pipe instead of in memory, and
+// is copied out of it first.
+static void fuse_example_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset,
+                                   struct fuse_file_info *fi) {
+    (void) fi;
+    size_t size = fuse_buf_size(bufv);
+    const char *data;
+    char *copy = NULL;
+    if (bufv->count == 1 && bufv->idx == 0 && bufv->off == 0 && !(bufv->buf[0].flags & FUSE_BUF_IS_FD)) {
+        data = bufv->buf[0].mem;
+    } else {
+        copy = malloc(size ? size : 1);
+        if (!copy) {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        }
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+        dst.buf[0].mem = copy;
+        ssize_t copied = fuse_buf_copy(&dst, bufv, 0);
+        if (copied < 0) {
+            free(copy);
+            fuse_reply_err(req, -copied);
+            return;
+        }
+        size = copied;
+        data = copy;
+    }
+
+    int res = node_write(node_inode(ino), data, size, offset);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        fuse_reply_write(req, res);
+    }
+    free(copy);
+}
+#endif
+
+static void fuse_example_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                                struct fuse_file_info *fi) {
+    (void) mode;
+    printf("fuse_example_create called with parent: %lu, name: %s\n", (unsigned long)parent, name);
+
+    struct stat stbuf;
+    int inode = node_create(node_inode(parent), name, FS_REG, &stbuf);
+    if (inode < 0) {
+        fuse_reply_err(req, -inode);
+    } else {
+        struct fuse_entry_param e;
+        node_entry(&e, inode, &stbuf);
+        fuse_reply_create(req, &e, fi);
+    }
+    printf("fuse_example_create returning: %d\n", inode < 0 ? inode : 0);
+}
+
+static void fuse_example_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    (void) mode;
+    printf("fuse_example_mkdir called with parent: %lu, name: %s\n", (unsigned long)parent, name);
+
+    struct stat stbuf;
+    int inode = node_create(node_inode(parent), name, FS_DIR, &stbuf);
+    if (inode < 0) {
+        fuse_reply_err(req, -inode);
+    } else {
+        struct fuse_entry_param e;
+        node_entry(&e, inode, &stbuf);
+        fuse_reply_entry(req, &e);
+    }
+    printf("fuse_example_mkdir returning: %d\n", inode < 0 ? inode : 0);
+}
+
+static void fuse_example_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    printf("fuse_example_unlink called with parent: %lu, name: %s\n", (unsigned long)parent, name);
+
+    int res = node_remove(node_inode(parent), name, false);
+    fuse_reply_err(req, -res);
+
+    printf("fuse_example_unlink returning: %d\n", res);
+}
+
+static void fuse_example_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    printf("fuse_example_rmdir called with parent: %lu, name: %s\n", (unsigned long)parent, name);
+
+    int res = node_remove(node_inode(parent), name, true);
+    fuse_reply_err(req, -res);
+
+    printf("fuse_example_rmdir returning: %d\n", res);
+}
+
+// Every change is in the journal already, so making a file durable means
+// syncing the journal, whichever file it is.
+static void fuse_example_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    (void) ino;
+    (void) datasync;
+    (void) fi;
+    fuse_reply_err(req, -journal_sync());
+}
+
+static void fuse_example_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void) ino;
+    (void) fi;
+    fuse_reply_err(req, -journal_sync());
+}
+
+// setfattr -n user.jsonfs.snapshot -v NAME <mount_point> takes a named
+// snapshot.
+static int node_setxattr(int inode, const char *name, const char *value, size_t size) {
+    if (inode != 0 || strcmp(name, SNAPSHOT_XATTR) != 0) return -ENOTSUP;
+    if (read_only) return -EROFS;
+
+    // The value becomes part of a file name, <image>.snapshot.NAME, which
+    // is first written under a temporary name with a suffix of its own.
+    const char *base = strrchr(image_path, '/');
+    base = base ? base + 1 : image_path;
+    size_t used = strlen(base) + strlen(".snapshot.") + strlen(".XXXXXX");
+    if (size == 0 || memchr(value, '/', size) || memchr(value, '\0', size)) return -EINVAL;
+    if (used >= NAME_MAX || size > NAME_MAX - used) return -ENAMETOOLONG;
+    char snapshot_name[NAME_MAX + 1];
+    memcpy(snapshot_name, value, size);
+    snapshot_name[size] = '\0';
+    return snapshot_named(snapshot_name);
+}
+
+static void fuse_example_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value,
+                                  size_t size, int flags) {
+    (void) flags;
+    fuse_reply_err(req, -node_setxattr(node_inode(ino), name, value, size));
+}
+
+
+static struct fuse_lowlevel_ops fuse_example_oper = {
+    .init = fuse_example_init,
+    .destroy = fuse_example_destroy,
+    .lookup = fuse_example_lookup,
+    .forget = fuse_example_forget,
+#if FUSE_USE_VERSION >= 30
+    .forget_multi = fuse_example_forget_multi,
+#endif
+    .getattr = fuse_example_getattr,
+    .setattr = fuse_example_setattr,
+    .open = fuse_example_open,
+    .read = fuse_example_read,
+    .readdir = fuse_example_readdir,
+#if FUSE_USE_VERSION >= 30
+    .readdirplus = fuse_example_readdirplus,
+    .write_buf = fuse_example_write_buf,
+#endif
+    .write = fuse_example_write,
+    .create = fuse_example_create,
+    .mkdir = fuse_example_mkdir,
+    .unlink = fuse_example_unlink,
+    .rmdir = fuse_example_rmdir,
+    .fsync = fuse_example_fsync,
+    .flush = fuse_example_flush,
+    .setxattr = fuse_example_setxattr,
+};
+
+
+
+struct fuse_example_config {
+    double entry_timeout;
+    double attr_timeout;
+    double negative_timeout;
+    int max_inodes;
+    int max_dir_entries;
+    int load_threads;
+    int save_threads;
+    int pretty_json;
+    int data_cache;  // MiB
+    char *image;
+    char *journal;
+    int no_journal;
+    int commit_delay;  // microseconds
+    int checkpoint_interval;  // seconds
+    int compact_segments;
+    char *snapshot;
+    int convert;
+#if FUSE_USE_VERSION >= 30
+    int writeback_cache;
+    int parallel_dirops;
+    char *readdirplus;
+    int splice_read;
+    int splice_write;
+    int max_write;
+#endif
+};
+
+#define FUSE_EXAMPLE_OPT(t, p) { t, offsetof(struct fuse_example_config, p), 0 }
+
+static struct fuse_opt fuse_example_opts[] = {
+    FUSE_EXAMPLE_OPT("entry_timeout=%lf", entry_timeout),
+    FUSE_EXAMPLE_OPT("attr_timeout=%lf", attr_timeout),
+    FUSE_EXAMPLE_OPT("negative_timeout=%lf", negative_timeout),
+    FUSE_EXAMPLE_OPT("max_inodes=%d", max_inodes),
+    FUSE_EXAMPLE_OPT("max_dir_entries=%d", max_dir_entries),
+    FUSE_EXAMPLE_OPT("load_threads=%d", load_threads),
+    FUSE_EXAMPLE_OPT("--load-threads=%d", load_threads),
+    FUSE_EXAMPLE_OPT("save_threads=%d", save_threads),
+    { "pretty_json", offsetof(struct fuse_example_config, pretty_json), 1 },
+    FUSE_EXAMPLE_OPT("data_cache=%d", data_cache),
+    FUSE_EXAMPLE_OPT("image=%s", image),
+    FUSE_EXAMPLE_OPT("journal=%s", journal),
+    { "no_journal", offsetof(struct fuse_example_config, no_journal), 1 },
+    FUSE_EXAMPLE_OPT("commit_delay=%d", commit_delay),
+    FUSE_EXAMPLE_OPT("checkpoint_interval=%d", checkpoint_interval),
+    FUSE_EXAMPLE_OPT("compact_segments=%d", compact_segments),
+    FUSE_EXAMPLE_OPT("snapshot=%s", snapshot),
+    { "--convert", offsetof(struct fuse_example_config, convert), 1 },
+#if FUSE_USE_VERSION >= 30
+    // libfuse 2 takes max_write itself.
+    FUSE_EXAMPLE_OPT("writeback_cache=%d", writeback_cache),
+    FUSE_EXAMPLE_OPT("parallel_dirops=%d", parallel_dirops),
+    FUSE_EXAMPLE_OPT("readdirplus=%s", readdirplus),
+    FUSE_EXAMPLE_OPT("splice_read=%d", splice_read),
+    FUSE_EXAMPLE_OPT("splice_write=%d", splice_write),
+    FUSE_EXAMPLE_OPT("max_write=%d", max_write),
+#endif
+    FUSE_OPT_END
+};
+
+int main(int argc, char *argv[]) {
+	pthread_mutex_init(&fs_mutex,NULL);
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_example_config config = {
+        .entry_timeout = DEFAULT_ENTRY_TIMEOUT,
+        .attr_timeout = DEFAULT_ATTR_TIMEOUT,
+        .negative_timeout = DEFAULT_NEGATIVE_TIMEOUT,
+        .max_inodes = DEFAULT_MAX_INODES,
+        .max_dir_entries = DEFAULT_MAX_DIR_ENTRIES,
+        .data_cache = DEFAULT_DATA_CACHE_MB,
+        .commit_delay = DEFAULT_COMMIT_DELAY_US,
+        .checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL,
+        .compact_segments = DEFAULT_COMPACT_SEGMENTS,
+#if FUSE_USE_VERSION >= 30
+        .writeback_cache = 1,
+        .parallel_dirops = 1,
+        .max_write = DEFAULT_MAX_WRITE,
+#endif
+    };
+    if (fuse_opt_parse(&args, &config, fuse_example_opts, NULL) == -1) {
+        return 1;
+    }
+    if (config.max_inodes <= 0 || config.max_dir_entries <= 0) {
+        fprintf(stderr, "max_inodes and max_dir_entries must be positive\n");
+        return 1;
+    }
+    if (config.data_cache < 0 || config.commit_delay < 0 || config.checkpoint_interval < 0 || config.compact_segments < 0) {
+        fprintf(stderr, "data_cache, commit_delay, checkpoint_interval and compact_segments must not be negative\n");
+        return 1;
+    }
+    if (config.entry_timeout < 0 || config.attr_timeout < 0 || config.negative_timeout < 0) {
+        fprintf(stderr, "entry_timeout, attr_timeout and negative_timeout must not be negative\n");
+        return 1;
+    }
+    entry_timeout = config.entry_timeout;
+    attr_timeout = config.attr_timeout;
+    negative_timeout = config.negative_timeout;
+    max_inodes = config.max_inodes;
+    max_dir_entries = config.max_dir_entries;
+    load_threads = config.load_threads;
+    save_threads = config.save_threads;
+    json_pretty = config.pretty_json;
+    data_cache_limit = (size_t)config.data_cache << 20;
+    commit_delay_us = config.commit_delay;
+    checkpoint_interval = config.checkpoint_interval;
+    compact_segments = config.compact_segments;
+#if FUSE_USE_VERSION >= 30
+    if (config.readdirplus && strcmp(config.readdirplus, "yes") != 0 && strcmp(config.readdirplus, "no") != 0
+        && strcmp(config.readdirplus, "auto") != 0) {
+        fprintf(stderr, "readdirplus must be yes, no or auto\n");
+        return 1;
+    }
+    if (config.max_write < 4096) {
+        fprintf(stderr, "max_write must be at least 4096\n");
+        return 1;
+    }
+    writeback_cache = config.writeback_cache;
+    parallel_dirops = config.parallel_dirops;
+    if (config.readdirplus) readdirplus = config.readdirplus;
+    splice_read = config.splice_read;
+    splice_write = config.splice_write;
+    max_write = config.max_write;
+#endif
+
+    // fuse_example --convert IN OUT: rewrite a JSON image as a binary one
+    // or the other way round, whichever IN is not.
+    if (config.convert) {
+        if (args.argc != 3) {
+            fprintf(stderr, "usage: %s --convert IN OUT\n", argv[0]);
+            return 1;
+        }
+        int res;
+        if (is_binary_image(args.argv[1])) {
+            load_binary_image(args.argv[1]);
+            res = store_file_system(args.argv[2]);
+        } else {
+            load_json_fs(args.argv[1]);
+            res = store_binary_image(args.argv[2]);
+        }
+        fuse_opt_free_args(&args);
+        return res != 0;
+    }
+
+    const char *image = config.image ? config.image : "fs.json";
+    // Snapshots are written after libfuse has changed to "/".
+    image_path = absolute_path(image);
+    if (!image_path) {
+        perror(image);
+        return 1;
+    }
+    if (config.snapshot) {
+        // A named snapshot of the image, read-only and without a journal.
+        char *path = snapshot_image_path(image, config.snapshot);
+        if (!path) return 1;
+        load_binary_image(path);
+        read_only = true;
+        fuse_opt_add_arg(&args, "-oro");
+    } else if (config.image) {
+        load_binary_image(image);
+        mounted_binary_image = true;
+    } else {
+        load_json_fs(image);
+    }
+
+    // The journal defaults to the image's name plus ".journal".
+    if (!config.no_journal && !read_only) {
+        char *journal = config.journal;
+        if (!journal) {
+            journal = malloc(strlen(image) + sizeof(".journal"));
+            if (!journal) return 1;
+            sprintf(journal, "%s.journal", image);
+        }
+        journal_open(journal, image);
+        checkpoint_init();
+    }
+
+#if FUSE_USE_VERSION >= 30
+    struct fuse_cmdline_opts opts;
+    if (fuse_parse_cmdline(&args, &opts) != 0) {
+        return 1;
+    }
+    if (opts.show_help || opts.show_version) {
+        if (opts.show_help) {
+            printf("usage: %s [options] <mount_point>\n\n", argv[0]);
+            fuse_cmdline_help();
+            fuse_lowlevel_help();
+        } else {
+            printf("FUSE library version %s\n", fuse_pkgversion());
+            fuse_lowlevel_version();
+        }
+        free(opts.mountpoint);
+        fuse_opt_free_args(&args);
+        return 0;
+    }
+    if (!opts.mountpoint) {
+        fprintf(stderr, "usage: %s [options] <mount_point>\n", argv[0]);
+        return 1;
+    }
+
+    int ret = 1;
+    struct fuse_session *se = fuse_session_new(&args, &fuse_example_oper, sizeof(fuse_example_oper), NULL);
+    if (se) {
+        if (fuse_set_signal_handlers(se) == 0) {
+            if (fuse_session_mount(se, opts.mountpoint) == 0) {
+                if (fuse_daemonize(opts.foreground) == 0) {
+                    ret = opts.singlethread ? fuse_session_loop(se) : fuse_session_loop_mt(se, opts.clone_fd);
+                }
+                fuse_session_unmount(se);
+            }
+            fuse_remove_signal_handlers(se);
+        }
+        fuse_session_destroy(se);
+    }
+    free(opts.mountpoint);
+#else
+    char *mountpoint;
+    int multithreaded, foreground;
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1) {
+        return 1;
+    }
+    if (!mountpoint) {
+        fprintf(stderr, "usage: %s [options] <mount_point>\n", argv[0]);
+        return 1;
+    }
+
+    int ret = 1;
+    struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+    if (ch) {
+        struct fuse_session *se = fuse_lowlevel_new(&args, &fuse_example_oper, sizeof(fuse_example_oper), NULL);
+        if (se) {
+            if (fuse_set_signal_handlers(se) == 0) {
+                fuse_session_add_chan(se, ch);
+                if (fuse_daemonize(foreground) == 0) {
+                    ret = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                }
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    free(mountpoint);
+#endif
+    fuse_opt_free_args(&args);
+    return ret != 0;
+}